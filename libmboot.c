@@ -0,0 +1,3133 @@
+/* libmboot.c - unpack and repack Intel boot.img for Android
+**
+** Based on https://github.com/osm0sis/mboot_py/blob/master/mboot.py
+**
+** Copyright 2014 Jocelyn Falempe (Intel Corporation)
+** Copyright 2019 Chris Renshaw (osm0sis @ xda-developers)
+**                Shaka Huang (shakalaca @ xda-developers / ASUS ZenTalk)
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms and conditions of the GNU General Public License,
+** version 2, as published by the Free Software Foundation.
+**
+** This program is distributed in the hope it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+
+#include "mboot.h"
+
+#ifdef _WIN32
+#include <io.h>
+
+#define fsync _commit
+
+// mingw lacks positional i/o so emulate it with a seek on the descriptor
+static ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) == (-1)) {
+		return -1;
+	}
+	return read(fd, buf, count);
+}
+
+static ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	if (lseek(fd, offset, SEEK_SET) == (-1)) {
+		return -1;
+	}
+	return write(fd, buf, count);
+}
+#endif
+
+// fixed buffer size used to stream components into the packed image
+#define PACK_BUFFER_SIZE 65536
+
+// the pack reader stage prefetches up to PIPELINE_CHUNKS chunks ahead of the writer
+#define PIPELINE_CHUNK_SIZE (1024 * 1024)
+#define PIPELINE_CHUNKS 8
+
+// sections at least this large get their own writer thread during unpack
+#define SECTION_THREAD_MIN (256 * 1024)
+
+// use custom functions since it seems libc isalnum() cannot be trusted cross-platform
+static int xisalpha(int c) { return ((unsigned int)(c|('A'^'a')) - 'a') <= 'z'-'a'; }  
+static int xisdigit(int c) { return ((unsigned int)(c - '0')) < 10; } 
+static int xisalnum(int c) { return (xisalpha(c) || xisdigit(c)); }
+static int xisxdigit(int c) { return xisdigit(c) || ((unsigned int)((c|('A'^'a')) - 'a')) < 6; }
+
+static int check_byte(struct mboot_ctx *ctx, const unsigned char *buf, long offset, int size, int min)
+{
+	int debug = ctx ? ctx->debug : 0;
+	int bytes = 0;
+
+	int i;
+	for (i = 0; i < size; i++) {
+		bytes = bytes + xisalnum((int)buf[offset + i]);
+		if (debug > 1) {
+			printf("%d 0x%02X\n", bytes, buf[offset + i]);
+		}
+	}
+	if (debug) {
+		printf("%4ld: %d\n", offset, bytes);
+	}
+
+	// add custom fault tolerance to try and avoid false positives
+	return (bytes >= min);
+}
+
+// bytes classified per candidate cmdline boundary when scoring layouts
+#define DETECT_WINDOW 64
+
+// NUL, alphanumeric and printable ASCII (alphanumerics included) byte counts of a window
+struct byte_classes {
+	int nul;
+	int alnum;
+	int print;
+};
+
+static void classify_bytes(const unsigned char *buf, int len, struct byte_classes *c)
+{
+	int i = 0;
+
+	memset(c, 0, sizeof(*c));
+#ifdef __SSE2__
+	// signed compares leave bytes from 0x80 up negative, outside every ASCII range
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		__m128i lower = _mm_or_si128(v, _mm_set1_epi8('A' ^ 'a'));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			_mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+		__m128i print = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+		c->nul += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())));
+		c->alnum += __builtin_popcount(_mm_movemask_epi8(_mm_or_si128(digit, alpha)));
+		c->print += __builtin_popcount(_mm_movemask_epi8(print));
+	}
+#endif
+	for (; i < len; i++) {
+		c->nul += buf[i] == 0;
+		c->alnum += xisalnum(buf[i]);
+		c->print += buf[i] >= 0x20 && buf[i] < 0x7F;
+	}
+}
+
+// score out of 100 for the cmdline block starting at offset followed by a bootstub of bootstub_size:
+// 40 for a window of text and NUL padding, 20 for leading alphanumerics, 30 for kernel and ramdisk sizes
+// that are sane and fit the image, and 10 more when the padded ramdisk ends exactly where the image does,
+// going by the header's sector count if there is a header and by the size of the image otherwise
+static int score_layout(struct mboot_ctx *ctx, const unsigned char *probe, long image_size, long hdr_size,
+	long offset, long bootstub_size)
+{
+	struct byte_classes window, lead;
+	uint32_t kernel_size, ramdisk_size;
+
+	classify_bytes(probe + offset, DETECT_WINDOW, &window);
+	classify_bytes(probe + offset, 4, &lead);
+	memcpy(&kernel_size, probe + offset + 1024, 4);
+	memcpy(&ramdisk_size, probe + offset + 1028, 4);
+
+	int score = (window.print + window.nul) * 40 / DETECT_WINDOW + lead.alnum * 5;
+	long end = offset + 4096 + bootstub_size + (long)kernel_size + ramdisk_size;
+	if (kernel_size >= 500000 && kernel_size <= 15000000 && ramdisk_size >= 10000 && ramdisk_size <= 300000000 &&
+		end <= image_size) {
+		score += 30;
+
+		long image_end = image_size;
+		if (hdr_size > 0) {
+			uint32_t sectors;
+			memcpy(&sectors, probe + 48, 4);
+			image_end = ((long)sectors + 1) * 512;
+		}
+		if ((end + 511) / 512 * 512 == image_end) {
+			score += 10;
+		}
+	}
+	if (ctx && ctx->debug) {
+		printf("%4ld+%ld: %d%%\n", offset, bootstub_size, score);
+	}
+	return score;
+}
+
+void mboot_json_string(FILE *f, const char *string)
+{
+	fputc('"', f);
+	for (; *string; string++) {
+		unsigned char c = *string;
+		if (c == '"' || c == '\\') {
+			fprintf(f, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+const char *mboot_strerror(int err)
+{
+	switch (err) {
+	case MBOOT_OK:
+		return "success";
+	case MBOOT_E_KERNEL_SIZE:
+		return "kernel size likely wrong";
+	case MBOOT_E_RAMDISK_SIZE:
+		return "ramdisk size likely wrong";
+	case MBOOT_E_TRUNCATED:
+		return "image is truncated";
+	case MBOOT_E_IO:
+		return strerror(errno);
+	case MBOOT_E_TOO_SMALL:
+		return "output buffer too small";
+	default:
+		return "invalid argument";
+	}
+}
+
+// layout profiles: known fingerprints in the leading bytes that pin some or all of the section sizes,
+// one per line as 'NAME [hdr=N] [sig=N] [bootstub=N] OFFSET:HEX[/MASK]...', sizes left out are detected
+#define PROFILE_MATCHES 8
+#define PROFILE_BYTES 16
+
+struct profile_match {
+	long offset;
+	int len;
+	unsigned char bytes[PROFILE_BYTES];
+	unsigned char mask[PROFILE_BYTES];
+};
+
+struct mboot_profile {
+	char name[32];
+	long hdr_size;
+	long sig_size;
+	long bootstub_size;
+	int count;
+	struct profile_match match[PROFILE_MATCHES];
+};
+
+struct mboot_profiles {
+	int count;
+	struct mboot_profile *profile;
+	// checksum of the file the profiles came from, so cached layouts are only reused with the same ones
+	uint32_t id;
+};
+
+static const char *builtin_profiles[] = {
+	"osip hdr=512 0:244f5324",
+};
+
+static struct mboot_profiles builtin;
+static pthread_once_t builtin_once = PTHREAD_ONCE_INIT;
+
+static int parse_hex(const char *hex, unsigned char *out, int max)
+{
+	int len = 0;
+	unsigned int byte;
+	while (xisxdigit(hex[0]) && xisxdigit(hex[1]) && len < max) {
+		sscanf(hex, "%2x", &byte);
+		out[len++] = byte;
+		hex += 2;
+	}
+	return (*hex == '\0' || *hex == '/') ? len : -1;
+}
+
+// returns 1 for a blank or comment line, -1 if the line cannot be parsed
+static int parse_profile(char *line, struct mboot_profile *p)
+{
+	char *save = NULL;
+	char *word = strtok_r(line, " \t\r\n", &save);
+
+	if (!word || *word == '#') {
+		return 1;
+	}
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s", word);
+	p->hdr_size = p->sig_size = p->bootstub_size = -1;
+
+	while ((word = strtok_r(NULL, " \t\r\n", &save))) {
+		char *colon = strchr(word, ':');
+		if (!strncmp(word, "hdr=", 4)) {
+			p->hdr_size = atol(word + 4);
+		} else if (!strncmp(word, "sig=", 4)) {
+			p->sig_size = atol(word + 4);
+		} else if (!strncmp(word, "bootstub=", 9)) {
+			p->bootstub_size = atol(word + 9);
+		} else if (colon && p->count < PROFILE_MATCHES) {
+			struct profile_match *m = &p->match[p->count++];
+			char *slash = strchr(colon, '/');
+			m->offset = strtol(word, NULL, 0);
+			m->len = parse_hex(colon + 1, m->bytes, PROFILE_BYTES);
+			memset(m->mask, 0xFF, sizeof(m->mask));
+			if (m->len <= 0 || m->offset < 0 || m->offset + m->len > MBOOT_PROBE_SIZE ||
+				(slash && parse_hex(slash + 1, m->mask, PROFILE_BYTES) != m->len)) {
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+	}
+
+	// a profile pins a layout the heuristics could also have produced, never an arbitrary one
+	if ((p->hdr_size != -1 && p->hdr_size != 0 && p->hdr_size != 512) ||
+		(p->sig_size != -1 && p->sig_size != 0 && p->sig_size != 480 && p->sig_size != 728 && p->sig_size != 1024) ||
+		(p->bootstub_size != -1 && p->bootstub_size != 4096 && p->bootstub_size != 8192) || !p->count) {
+		return -1;
+	}
+	return 0;
+}
+
+static void add_profile(struct mboot_profiles *list, const struct mboot_profile *p)
+{
+	list->profile = realloc(list->profile, sizeof(struct mboot_profile) * (list->count + 1));
+	list->profile[list->count++] = *p;
+}
+
+static void builtin_init(void)
+{
+	struct mboot_profile p;
+	char line[256];
+	int i;
+
+	for (i = 0; i < (sizeof(builtin_profiles) / sizeof(builtin_profiles[0])); i++) {
+		snprintf(line, sizeof(line), "%s", builtin_profiles[i]);
+		if (!parse_profile(line, &p)) {
+			add_profile(&builtin, &p);
+		}
+	}
+}
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *data, long len);
+
+struct mboot_profiles *mboot_profiles_load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open profiles '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	struct mboot_profiles *list = calloc(1, sizeof(*list));
+	struct mboot_profile p;
+	char line[1024];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		list->id = crc32c_update(list->id, (const unsigned char *)line, strlen(line));
+		int ret = parse_profile(line, &p);
+		if (ret < 0) {
+			fprintf(stderr, "mboot: %s:%d: expected 'NAME [hdr=N] [sig=N] [bootstub=N] OFFSET:HEX[/MASK]...'\n",
+				path, lineno);
+			mboot_profiles_free(list);
+			fclose(f);
+			return NULL;
+		}
+		if (ret == 0) {
+			add_profile(list, &p);
+		}
+	}
+	fclose(f);
+	return list;
+}
+
+void mboot_profiles_free(struct mboot_profiles *list)
+{
+	if (list) {
+		free(list->profile);
+		free(list);
+	}
+}
+
+static const struct mboot_profile *find_profile(const struct mboot_profiles *list, const unsigned char *probe)
+{
+	int i, j, k;
+
+	for (i = 0; list && i < list->count; i++) {
+		const struct mboot_profile *p = &list->profile[i];
+		for (j = 0; j < p->count; j++) {
+			const struct profile_match *m = &p->match[j];
+			for (k = 0; k < m->len && (probe[m->offset + k] & m->mask[k]) == (m->bytes[k] & m->mask[k]); k++);
+			if (k < m->len) {
+				break;
+			}
+		}
+		if (j == p->count) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// the caller's profiles take precedence over the built-in ones
+static const struct mboot_profile *match_profile(struct mboot_ctx *ctx, const unsigned char *probe)
+{
+	const struct mboot_profile *p = find_profile(ctx ? ctx->profiles : NULL, probe);
+	if (!p) {
+		pthread_once(&builtin_once, builtin_init);
+		p = find_profile(&builtin, probe);
+	}
+	if (p && ctx && ctx->debug) {
+		printf("profile: %s\n", p->name);
+	}
+	return p;
+}
+
+// layout with the sizes p names pinned and the rest probed for, p may be NULL to probe for everything
+static int parse_layout(struct mboot_ctx *ctx, const unsigned char *probe, long image_size,
+	const struct mboot_profile *p, struct mboot_layout *l)
+{
+	memset(l, 0, sizeof(*l));
+	l->image_size = image_size;
+
+	// header is 512 bytes but may rarely not exist on some devices, and may have 480, 728 or 1024 bytes
+	// of signature appended on some devices, and the bootstub is 4096 bytes but can be 8192 bytes on some
+	// devices; score every combination and keep the best, with the runner-up showing how ambiguous the
+	// choice was
+	long hdr_sizes[] = { 512, 0 };
+	long sig_sizes[] = { 0, 480, 728, 1024 };
+	long bootstub_sizes[2];
+	int i, j, k;
+	l->confidence = -1;
+	for (i = 0; i < (sizeof(hdr_sizes) / sizeof(hdr_sizes[0])); i++) {
+		for (j = 0; j < (sizeof(sig_sizes) / sizeof(sig_sizes[0])); j++) {
+			if ((p && p->hdr_size >= 0 && p->hdr_size != hdr_sizes[i]) ||
+				(p && p->sig_size >= 0 && p->sig_size != sig_sizes[j])) {
+				continue;
+			}
+
+			// text right where an 8192 byte bootstub would end only decides a tie
+			long offset = hdr_sizes[i] + sig_sizes[j];
+			int bootstub_8k = check_byte(ctx, probe, offset + 4096 + 4096, 2, 1);
+			bootstub_sizes[0] = bootstub_8k ? 8192 : 4096;
+			bootstub_sizes[1] = bootstub_8k ? 4096 : 8192;
+			for (k = 0; k < 2; k++) {
+				if (p && p->bootstub_size >= 0 && p->bootstub_size != bootstub_sizes[k]) {
+					continue;
+				}
+				int score = score_layout(ctx, probe, image_size, hdr_sizes[i], offset, bootstub_sizes[k]);
+				if (score > l->confidence) {
+					l->runner_up = l->confidence > l->runner_up ? l->confidence : l->runner_up;
+					l->confidence = score;
+					l->hdr_size = hdr_sizes[i];
+					l->sig_size = sig_sizes[j];
+					l->bootstub_size = bootstub_sizes[k];
+				} else if (score > l->runner_up) {
+					l->runner_up = score;
+				}
+			}
+		}
+	}
+
+	// cmdline is up to 1024 bytes padded with \x00
+	l->cmdline_offset = l->hdr_size + l->sig_size;
+
+	// image info is the next 16 bytes padded out to 3072 bytes
+	memcpy(&l->kernel_size, probe + l->cmdline_offset + 1024, 4);
+	memcpy(&l->ramdisk_size, probe + l->cmdline_offset + 1028, 4);
+	l->parameter_offset = l->cmdline_offset + 1032;
+
+	l->bootstub_offset = l->cmdline_offset + 4096;
+
+	l->kernel_offset = l->bootstub_offset + l->bootstub_size;
+	l->ramdisk_offset = l->kernel_offset + l->kernel_size;
+
+	if (l->kernel_size < 500000 || l->kernel_size > 15000000) {
+		return MBOOT_E_KERNEL_SIZE;
+	}
+	if (l->ramdisk_size < 10000 || l->ramdisk_size > 300000000) {
+		return MBOOT_E_RAMDISK_SIZE;
+	}
+	if (l->ramdisk_offset + l->ramdisk_size > image_size) {
+		return MBOOT_E_TRUNCATED;
+	}
+
+	// the image may sit at the start of a larger partition, so work out where it really ends:
+	// the header's sector count when it is plausible, otherwise the padded end of the ramdisk
+	long payload_end = l->ramdisk_offset + l->ramdisk_size;
+	l->image_end = (payload_end + 511) / 512 * 512;
+	if (l->hdr_size > 0) {
+		uint32_t sectors;
+		memcpy(&sectors, probe + 48, 4);
+		long end = ((long)sectors + 1) * 512;
+		if (end >= payload_end && end <= image_size) {
+			l->image_end = end;
+		} else {
+			l->end_unknown = 1;
+		}
+	}
+	if (l->image_end > image_size) {
+		l->image_end = image_size;
+	}
+	return MBOOT_OK;
+}
+
+// compute the offsets and sizes of every section from the leading bytes of the image,
+// returns MBOOT_OK only if the whole layout fits inside an image of image_size bytes
+int mboot_parse_layout(struct mboot_ctx *ctx, const unsigned char *probe, long image_size, struct mboot_layout *l)
+{
+	// a known fingerprint fixes the sizes it names, but a fingerprint is only a hint: if the pinned
+	// sizes give an implausible layout the image is probed as if nothing had matched
+	const struct mboot_profile *p = match_profile(ctx, probe);
+	int ret = parse_layout(ctx, probe, image_size, p, l);
+	if (ret && p) {
+		if (ctx && ctx->debug) {
+			printf("profile: %s does not fit, probing instead\n", p->name);
+		}
+		ret = parse_layout(ctx, probe, image_size, NULL, l);
+	}
+	return ret;
+}
+
+// true if every byte of the word is 0x00 or 0xFF, i.e. all 8 bits of each byte are equal
+static int padding_word(uint64_t w)
+{
+	return ((w ^ (w << 1)) & 0xFEFEFEFEFEFEFEFEULL) == 0;
+}
+
+// scan [start, end) of fd backwards a word at a time and return the offset just past the last
+// byte that is not 0x00/0xFF padding
+static long trim_padding(int fd, long start, long end)
+{
+	uint64_t *buf = malloc(PACK_BUFFER_SIZE);
+	long pos = end;
+
+	while (pos > start) {
+		long len = pos - start < PACK_BUFFER_SIZE ? pos - start : PACK_BUFFER_SIZE;
+		if (pread(fd, buf, len, pos - len) != len) {
+			break;
+		}
+		const unsigned char *bytes = (const unsigned char *)buf;
+		long i = len;
+		while (i >= 8 && padding_word(buf[(i - 8) / 8]) && (i % 8) == 0) {
+			i -= 8;
+		}
+		while (i > 0 && (bytes[i - 1] == 0x00 || bytes[i - 1] == 0xFF)) {
+			i--;
+		}
+		if (i > 0) {
+			pos = pos - len + i;
+			break;
+		}
+		pos -= len;
+	}
+	free(buf);
+	return pos;
+}
+
+// size of the file or block device behind fd
+static long device_size(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == (-1)) {
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		return st.st_size;
+	}
+	return lseek(fd, 0, SEEK_END);
+}
+
+// copy size bytes at offset of in to the current position of out without a userspace buffer,
+// returns the number of bytes copied so the caller can finish the rest another way
+long mboot_copy_range(struct mboot_ctx *ctx, int in, long offset, int out, long size)
+{
+	long done = 0;
+#ifdef __linux__
+	loff_t in_off = offset;
+	ssize_t ret;
+
+#ifdef FICLONERANGE
+	// share the extents outright when both files are on a reflink-capable filesystem
+	struct file_clone_range range;
+	range.src_fd = in;
+	range.src_offset = offset;
+	range.src_length = size;
+	range.dest_offset = lseek(out, 0, SEEK_CUR);
+	if (size > 0 && range.dest_offset != (-1) && ioctl(out, FICLONERANGE, &range) == 0) {
+		lseek(out, size, SEEK_CUR);
+		return size;
+	}
+#endif
+#ifdef __NR_copy_file_range
+	while (done < size) {
+		ret = syscall(__NR_copy_file_range, in, &in_off, out, NULL, (size_t)(size - done), 0);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+	}
+#endif
+	// older kernels or filesystems without copy_file_range support can still use sendfile
+	off_t send_off = offset + done;
+	while (done < size) {
+		ret = sendfile(out, in, &send_off, size - done);
+		if (ret <= 0) {
+			break;
+		}
+		done += ret;
+	}
+	if (ctx && ctx->debug && done < size) {
+		printf("copy_range: %ld of %ld bytes copied in kernel\n", done, size);
+	}
+#endif
+	return done;
+}
+
+// section digests for the unpack manifest: CRC32C (Castagnoli) and SHA-256, updated chunk by chunk
+// in the same pass that writes the section out
+struct section_hash {
+	uint32_t crc;
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	unsigned char sha256[32];
+};
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init(void)
+{
+	uint32_t i, j;
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (j = 0; j < 8; j++) {
+			c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+		}
+		crc32c_table[i] = c;
+	}
+}
+
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char *data, long len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	while (len--) {
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+
+// the crc32 instruction of SSE4.2 computes exactly this polynomial, 8 bytes at a time
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, long len)
+{
+	uint64_t c = crc;
+	for (; len >= 8; data += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, data, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	crc = (uint32_t)c;
+	for (; len > 0; data++, len--) {
+		crc = _mm_crc32_u8(crc, *data);
+	}
+	return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *data, long len)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crc32c_sse42(crc, data, len);
+	}
+#endif
+	return crc32c_soft(crc, data, len);
+}
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	}
+	for (; i < 64; i++) {
+		uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void hash_init(struct section_hash *h)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(h->state, iv, sizeof(iv));
+	h->crc = 0xFFFFFFFF;
+	h->length = 0;
+}
+
+static void hash_update(struct section_hash *h, const unsigned char *data, long len)
+{
+	h->crc = crc32c_update(h->crc, data, len);
+
+	long used = h->length % 64;
+	h->length += len;
+	if (used) {
+		long fill = 64 - used < len ? 64 - used : len;
+		memcpy(h->block + used, data, fill);
+		data += fill;
+		len -= fill;
+		if (used + fill < 64) {
+			return;
+		}
+		sha256_block(h->state, h->block);
+	}
+	for (; len >= 64; data += 64, len -= 64) {
+		sha256_block(h->state, data);
+	}
+	memcpy(h->block, data, len);
+}
+
+static void hash_final(struct section_hash *h)
+{
+	uint64_t bits = h->length * 8;
+	long used = h->length % 64;
+	int i;
+
+	h->block[used++] = 0x80;
+	if (used > 56) {
+		memset(h->block + used, 0, 64 - used);
+		sha256_block(h->state, h->block);
+		used = 0;
+	}
+	memset(h->block + used, 0, 56 - used);
+	for (i = 0; i < 8; i++) {
+		h->block[56 + i] = bits >> (56 - i * 8);
+	}
+	sha256_block(h->state, h->block);
+	for (i = 0; i < 32; i++) {
+		h->sha256[i] = h->state[i / 4] >> (24 - (i % 4) * 8);
+	}
+	h->crc ^= 0xFFFFFFFF;
+}
+
+static int selected(struct mboot_ctx *ctx, int section)
+{
+	return !ctx->sections || (ctx->sections & section);
+}
+
+// where an unpacked section goes, its own file in the directory unless ctx->output is set
+static void section_path(struct mboot_ctx *ctx, char *name, char *outpath)
+{
+	if (ctx->output) {
+		snprintf(outpath, PATH_MAX, "%s", ctx->output);
+	} else {
+		snprintf(outpath, PATH_MAX, "%s/%s", ctx->directory, name);
+	}
+}
+
+static FILE *open_section(struct mboot_ctx *ctx, char *name, char *mode)
+{
+	char outpath[PATH_MAX];
+
+	if (ctx->output && !strcmp(ctx->output, "-")) {
+#ifdef _WIN32
+		_setmode(STDOUT_FILENO, _O_BINARY);
+#endif
+		fflush(stdout);
+		return stdout;
+	}
+	section_path(ctx, name, outpath);
+	FILE *t = fopen(outpath, mode);
+	if (!t) {
+		fprintf(stderr, "mboot: cannot open output file '%s': %s\n", outpath, strerror(errno));
+	}
+	return t;
+}
+
+// flush and close a section, returns 1 if any write to it failed
+static int close_section(struct mboot_ctx *ctx, FILE *t, char *name)
+{
+	char outpath[PATH_MAX];
+	int failed;
+
+	if (t == stdout) {
+		failed = fflush(t) != 0 || ferror(t);
+	} else {
+		failed = ferror(t);
+		failed = fclose(t) != 0 || failed;
+	}
+	if (failed) {
+		section_path(ctx, name, outpath);
+		fprintf(stderr, "mboot: cannot write output file '%s': %s\n", t == stdout ? "-" : outpath, strerror(errno));
+	}
+	return failed;
+}
+
+static int read_failed(struct mboot_ctx *ctx, int failed)
+{
+	if (failed) {
+		fprintf(stderr, "mboot: cannot read input file '%s': %s\n", ctx->filename, strerror(errno));
+	}
+	return failed;
+}
+
+// copy a section out of the image, hashing it chunk by chunk on the way when hash is set,
+// returns 1 if the section could not be read or written in full
+static int write_buffer(struct mboot_ctx *ctx, FILE *f, long offset, long size, char *name, struct section_hash *hash)
+{
+	FILE *t = open_section(ctx, name, "wb");
+	if (!t) {
+		return 1;
+	}
+	int failed = 0;
+	long done = 0;
+
+	// digests need the bytes in userspace, otherwise as much as possible is copied in the kernel; the copy
+	// advances the output descriptor, which t has not buffered anything ahead of
+	if (!hash) {
+		done = mboot_copy_range(ctx, fileno(f), ctx->base + offset, fileno(t), size);
+	}
+
+	// the rest is written from the mapped image when available, or read a chunk at a time so no section
+	// is ever held in memory whole, and hashed while it is still in cache
+	unsigned char *buffer = ctx->image_map || done == size ? NULL : malloc(PIPELINE_CHUNK_SIZE);
+	while (done < size) {
+		long len = size - done < PIPELINE_CHUNK_SIZE ? size - done : PIPELINE_CHUNK_SIZE;
+		const unsigned char *data = ctx->image_map + offset + done;
+		if (buffer) {
+			if (pread(fileno(f), buffer, len, ctx->base + offset + done) != len) {
+				failed = 1;
+				break;
+			}
+			data = buffer;
+		}
+		if (hash) {
+			hash_update(hash, data, len);
+		}
+		fwrite(data, len, 1, t);
+		done += len;
+	}
+	free(buffer);
+	return read_failed(ctx, failed) | close_section(ctx, t, name);
+}
+
+// map only the image itself, not whatever partition space or dump surrounds it
+static void map_image(struct mboot_ctx *ctx, FILE *f, long size)
+{
+#ifndef _WIN32
+	struct stat st;
+	if (fstat(fileno(f), &st) == (-1) || !(S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) || size <= 0) {
+		return;
+	}
+
+	// mappings start on a page boundary, so map from the one before ctx->base and point past the gap
+	long gap = ctx->base % sysconf(_SC_PAGESIZE);
+	unsigned char *map = mmap(NULL, size + gap, PROT_READ, MAP_PRIVATE, fileno(f), ctx->base - gap);
+	if (map == MAP_FAILED) {
+		return;
+	}
+	madvise(map, size + gap, MADV_SEQUENTIAL);
+	ctx->image_map = map + gap;
+	ctx->image_map_size = size;
+#endif
+}
+
+static void unmap_image(struct mboot_ctx *ctx)
+{
+#ifndef _WIN32
+	if (ctx->image_map) {
+		long gap = ctx->base % sysconf(_SC_PAGESIZE);
+		munmap(ctx->image_map - gap, ctx->image_map_size + gap);
+	}
+#endif
+	ctx->image_map = NULL;
+	ctx->image_map_size = 0;
+}
+
+static int write_string(struct mboot_ctx *ctx, char *string, char *name)
+{
+	FILE *t = open_section(ctx, name, "w");
+	if (!t) {
+		return 1;
+	}
+
+	fwrite(string, strlen(string), 1, t);
+	return close_section(ctx, t, name);
+}
+
+// persistent layout cache: an append-only text file of detected layouts keyed by file identity,
+// where a later line for the same device and inode replaces an earlier one
+#define CACHE_MAGIC "mboot-layout-cache 3"
+
+struct cache_entry {
+	unsigned long long dev;
+	unsigned long long ino;
+	long long size;
+	long long mtime;
+	long mtime_nsec;
+	uint32_t profiles;
+	struct mboot_layout l;
+};
+
+struct mboot_cache {
+	pthread_mutex_t lock;
+	int fd;
+	struct cache_entry *entries;
+	int count;
+	int alloc;
+	int *slots;
+	int nslots;
+};
+
+// only regular files are cached, a block device can change without its node changing; the caller's
+// profiles are part of the key as they can change which layout is detected
+static int cache_key(struct mboot_ctx *ctx, const struct stat *st, struct cache_entry *e)
+{
+	if (!S_ISREG(st->st_mode)) {
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	// the nanoseconds are st_mtimespec on Darwin and missing on Windows, where seconds have to do
+#if defined(__APPLE__)
+	e->mtime_nsec = st->st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+	e->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+	e->profiles = ctx->profiles ? ctx->profiles->id : 0;
+	return 0;
+}
+
+static unsigned cache_hash(unsigned long long dev, unsigned long long ino)
+{
+	uint64_t h = (dev * 0x9E3779B97F4A7C15ULL) ^ ino;
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	return h ^ (h >> 32);
+}
+
+// slot of the entry for dev and ino, or of the empty slot it would go in
+static int cache_slot(struct mboot_cache *c, unsigned long long dev, unsigned long long ino)
+{
+	int i = cache_hash(dev, ino) & (c->nslots - 1);
+	while (c->slots[i] >= 0 && (c->entries[c->slots[i]].dev != dev || c->entries[c->slots[i]].ino != ino)) {
+		i = (i + 1) & (c->nslots - 1);
+	}
+	return i;
+}
+
+static void cache_insert(struct mboot_cache *c, const struct cache_entry *e)
+{
+	int i;
+
+	// keep the table at most half full
+	if ((c->count + 1) * 2 > c->nslots) {
+		free(c->slots);
+		c->nslots = c->nslots ? c->nslots * 2 : 1024;
+		c->slots = malloc(sizeof(int) * c->nslots);
+		memset(c->slots, 0xFF, sizeof(int) * c->nslots);
+		for (i = 0; i < c->count; i++) {
+			c->slots[cache_slot(c, c->entries[i].dev, c->entries[i].ino)] = i;
+		}
+	}
+
+	int slot = cache_slot(c, e->dev, e->ino);
+	if (c->slots[slot] >= 0) {
+		c->entries[c->slots[slot]] = *e;
+		return;
+	}
+	if (c->count == c->alloc) {
+		c->alloc = c->alloc ? c->alloc * 2 : 256;
+		c->entries = realloc(c->entries, sizeof(struct cache_entry) * c->alloc);
+	}
+	c->entries[c->count] = *e;
+	c->slots[slot] = c->count++;
+}
+
+static int cache_format(char *line, size_t size, const struct cache_entry *e)
+{
+	const struct mboot_layout *l = &e->l;
+	return snprintf(line, size, "%llu %llu %lld %lld %ld %u %ld %ld %ld %ld %ld %ld %ld %u %ld %u %ld %ld %d %d %d\n",
+		e->dev, e->ino, e->size, e->mtime, e->mtime_nsec, e->profiles, l->hdr_size, l->sig_size, l->cmdline_offset,
+		l->parameter_offset, l->bootstub_offset, l->bootstub_size, l->kernel_offset, l->kernel_size,
+		l->ramdisk_offset, l->ramdisk_size, l->image_size, l->image_end, l->end_unknown, l->confidence, l->runner_up);
+}
+
+static int cache_parse(const char *line, struct cache_entry *e)
+{
+	struct mboot_layout *l = &e->l;
+	memset(e, 0, sizeof(*e));
+	return sscanf(line, "%llu %llu %lld %lld %ld %u %ld %ld %ld %ld %ld %ld %ld %u %ld %u %ld %ld %d %d %d",
+		&e->dev, &e->ino, &e->size, &e->mtime, &e->mtime_nsec, &e->profiles, &l->hdr_size, &l->sig_size, &l->cmdline_offset,
+		&l->parameter_offset, &l->bootstub_offset, &l->bootstub_size, &l->kernel_offset, &l->kernel_size,
+		&l->ramdisk_offset, &l->ramdisk_size, &l->image_size, &l->image_end, &l->end_unknown,
+		&l->confidence, &l->runner_up) == 21 ? 0 : -1;
+}
+
+struct mboot_cache *mboot_cache_open(const char *path)
+{
+	struct mboot_cache *c = calloc(1, sizeof(*c));
+	char line[512];
+	int lines = 0;
+	int valid = 0;
+	int i;
+
+	pthread_mutex_init(&c->lock, NULL);
+	FILE *f = fopen(path, "r");
+	if (f) {
+		valid = fgets(line, sizeof(line), f) && !strncmp(line, CACHE_MAGIC "\n", sizeof(line));
+		if (valid) {
+			struct cache_entry e;
+			while (fgets(line, sizeof(line), f)) {
+				if (!cache_parse(line, &e)) {
+					cache_insert(c, &e);
+					lines++;
+				}
+			}
+		}
+		fclose(f);
+	}
+
+	// start over when the file is missing, from another version, or has built up mostly superseded lines,
+	// otherwise append to it
+	if (!valid || lines > 2 * c->count + 1024) {
+		char tmp[PATH_MAX];
+		snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+		f = fopen(tmp, "w");
+		if (f) {
+			fprintf(f, "%s\n", CACHE_MAGIC);
+			for (i = 0; i < c->count; i++) {
+				cache_format(line, sizeof(line), &c->entries[i]);
+				fputs(line, f);
+			}
+			if (fclose(f) || rename(tmp, path)) {
+				remove(tmp);
+			}
+		}
+	}
+	c->fd = open(path, O_WRONLY | O_APPEND);
+	if (c->fd < 0) {
+		fprintf(stderr, "mboot: cannot open layout cache '%s': %s\n", path, strerror(errno));
+	}
+	return c;
+}
+
+void mboot_cache_close(struct mboot_cache *c)
+{
+	if (!c) {
+		return;
+	}
+	if (c->fd >= 0) {
+		close(c->fd);
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c->entries);
+	free(c->slots);
+	free(c);
+}
+
+static int cache_lookup(struct mboot_cache *c, const struct cache_entry *key, struct mboot_layout *l)
+{
+	int hit = 0;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->nslots) {
+		int slot = c->slots[cache_slot(c, key->dev, key->ino)];
+		if (slot >= 0) {
+			struct cache_entry *e = &c->entries[slot];
+			hit = e->size == key->size && e->mtime == key->mtime && e->mtime_nsec == key->mtime_nsec &&
+				e->profiles == key->profiles;
+			if (hit) {
+				*l = e->l;
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return hit;
+}
+
+// one write per new layout keeps the file usable even if mboot is killed halfway through a run
+static void cache_store(struct mboot_cache *c, struct cache_entry *e, const struct mboot_layout *l)
+{
+	char line[512];
+
+	e->l = *l;
+	pthread_mutex_lock(&c->lock);
+	cache_insert(c, e);
+	if (c->fd >= 0) {
+		int len = cache_format(line, sizeof(line), e);
+		if (write(c->fd, line, len) != len) {
+			close(c->fd);
+			c->fd = -1;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+// a hit costs a single stat of filename
+int mboot_cache_lookup(struct mboot_ctx *ctx, const char *filename, struct mboot_layout *l)
+{
+	struct cache_entry key;
+	struct stat st;
+
+	return ctx->cache && stat(filename, &st) == 0 && !cache_key(ctx, &st, &key) && cache_lookup(ctx->cache, &key, l);
+}
+
+// read everything layout detection needs at once so it can be validated before any output
+// as mboot_load_layout(), leaving the caller to report a layout that does not fit
+static int load_layout(struct mboot_ctx *ctx, FILE *f, unsigned char *probe, struct mboot_layout *l)
+{
+	struct cache_entry key;
+	struct stat st;
+
+	memset(probe, 0, MBOOT_PROBE_SIZE);
+	long size = device_size(fileno(f)) - ctx->base;
+	if (size < 0 || pread(fileno(f), probe, MBOOT_PROBE_SIZE, ctx->base) < 0) {
+		fprintf(stderr, "mboot: cannot read input file '%s': %s\n", ctx->filename, strerror(errno));
+		return MBOOT_E_IO;
+	}
+
+	// a cached layout for this exact file skips detection and any padding scan, the cache only knows
+	// about images at the start of a file
+	int cacheable = ctx->cache && !ctx->base && fstat(fileno(f), &st) == 0 && !cache_key(ctx, &st, &key);
+	if (cacheable && cache_lookup(ctx->cache, &key, l)) {
+		return MBOOT_OK;
+	}
+
+	int ret = mboot_parse_layout(ctx, probe, size, l);
+	if (ret) {
+		return ret;
+	}
+
+	// a header that cannot be trusted for the image end leaves trimming the trailing padding
+	if (l->end_unknown && size > l->image_end) {
+		l->image_end = trim_padding(fileno(f), ctx->base + l->image_end, ctx->base + size) - ctx->base;
+		l->image_end = (l->image_end + 511) / 512 * 512;
+	}
+	if (cacheable) {
+		cache_store(ctx->cache, &key, l);
+	}
+	return ret;
+}
+
+int mboot_load_layout(struct mboot_ctx *ctx, FILE *f, unsigned char *probe, struct mboot_layout *l)
+{
+	int ret = load_layout(ctx, f, probe, l);
+	if (ret && ret != MBOOT_E_IO) {
+		fprintf(stderr, "mboot: unpacking error: %s\n", mboot_strerror(ret));
+	}
+	return ret;
+}
+
+// one section of the image to write out, on its own thread when large enough
+struct section_writer {
+	struct mboot_ctx *ctx;
+	FILE *f;
+	long offset;
+	long size;
+	char *name;
+	int section;
+	pthread_t thread;
+	int threaded;
+	struct section_hash hash;
+	int ret;
+};
+
+static void *section_writer(void *arg)
+{
+	struct section_writer *w = arg;
+	w->ret = write_buffer(w->ctx, w->f, w->offset, w->size, w->name, w->ctx->manifest ? &w->hash : NULL);
+	return NULL;
+}
+
+static void print_sizes(struct mboot_ctx *ctx, struct mboot_layout *l)
+{
+	if (ctx->quiet) {
+		return;
+	}
+	printf("header size   %ld\n", l->hdr_size);
+	printf("sig size      %ld\n", l->sig_size);
+	printf("bootstub size %ld\n", l->bootstub_size);
+	printf("kernel size   %d\n", l->kernel_size);
+	printf("ramdisk size  %d\n", l->ramdisk_size);
+}
+
+static int write_cmdline(struct mboot_ctx *ctx, const unsigned char *probe, struct mboot_layout *l)
+{
+	char cmdline[1024 + 1];
+	memcpy(cmdline, probe + l->cmdline_offset, 1024);
+	cmdline[1024] = '\0';
+	return write_string(ctx, cmdline, "cmdline.txt");
+}
+
+// names of the MBOOT_SECTION_* bits, as accepted by --only
+static const char *section_name(int section)
+{
+	static const char *names[] = { "hdr", "sig", "cmdline", "parameter", "bootstub", "kernel", "ramdisk" };
+	int i;
+
+	for (i = 0; !(section & (1 << i)); i++);
+	return names[i];
+}
+
+static void print_hash(FILE *m, const char *name, const char *file, long offset, long size, struct section_hash *h)
+{
+	int i;
+
+	fprintf(m, "    {\"name\": \"%s\", \"file\": \"%s\", \"offset\": %ld, \"size\": %ld, \"crc32c\": \"%08x\", \"sha256\": \"",
+		name, file, offset, size, h->crc);
+	for (i = 0; i < 32; i++) {
+		fprintf(m, "%02x", h->sha256[i]);
+	}
+	fprintf(m, "\"}");
+}
+
+// record where every unpacked section came from and its digests in DIR/manifest.json,
+// the cmdline entry covers only the leading part of its 1024 byte field that cmdline.txt holds
+static int write_manifest(struct mboot_ctx *ctx, const unsigned char *probe, struct mboot_layout *l,
+	struct section_writer *sections, int count)
+{
+	char path[PATH_MAX];
+	struct section_hash cmdline;
+	long cmdline_size = strnlen((const char *)probe + l->cmdline_offset, 1024);
+	int cmdline_done = !selected(ctx, MBOOT_SECTION_CMDLINE);
+	int first = 1;
+	int i;
+
+	sprintf(path, "%s/manifest.json", ctx->directory);
+	FILE *m = fopen(path, "w");
+	if (!m) {
+		fprintf(stderr, "mboot: cannot open output file '%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	hash_init(&cmdline);
+	hash_update(&cmdline, probe + l->cmdline_offset, cmdline_size);
+	hash_final(&cmdline);
+
+	fprintf(m, "{\n  \"image\": ");
+	mboot_json_string(m, ctx->filename);
+	fprintf(m, ",\n  \"image_end\": %ld,\n  \"sections\": [\n", l->image_end);
+	for (i = 0; i <= count; i++) {
+		if (!cmdline_done && (i == count || sections[i].offset > l->cmdline_offset)) {
+			fprintf(m, first ? "" : ",\n");
+			print_hash(m, section_name(MBOOT_SECTION_CMDLINE), "cmdline.txt", l->cmdline_offset, cmdline_size, &cmdline);
+			cmdline_done = 1;
+			first = 0;
+		}
+		if (i < count && sections[i].size > 0) {
+			fprintf(m, first ? "" : ",\n");
+			print_hash(m, section_name(sections[i].section), sections[i].name, sections[i].offset, sections[i].size, &sections[i].hash);
+			first = 0;
+		}
+	}
+	fprintf(m, "\n  ]\n}\n");
+	int failed = ferror(m);
+	if (fclose(m) || failed) {
+		fprintf(stderr, "mboot: cannot write output file '%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+// sequential reader over a non-seekable input, replaying the lookahead buffer first
+struct stream_input {
+	int fd;
+	const unsigned char *probe;
+	long probe_len;
+	long pos;
+	unsigned char *buffer;
+};
+
+// copy [offset, offset + size) of the input to name, discarding anything between the current position and offset
+static int stream_section(struct mboot_ctx *ctx, struct stream_input *in, long offset, long size, char *name,
+	struct section_hash *hash)
+{
+	FILE *t = open_section(ctx, name, "wb");
+	if (!t) {
+		return 1;
+	}
+
+	long end = offset + size;
+	while (in->pos < end) {
+		const unsigned char *data;
+		long len;
+		if (in->pos < in->probe_len) {
+			data = in->probe + in->pos;
+			len = in->probe_len - in->pos;
+		} else {
+			len = end - in->pos < PACK_BUFFER_SIZE ? end - in->pos : PACK_BUFFER_SIZE;
+			len = read(in->fd, in->buffer, len);
+			if (len < 0 && errno == EINTR) {
+				continue;
+			}
+			if (len <= 0) {
+				fprintf(stderr, "mboot: unpacking error: %s\n", mboot_strerror(MBOOT_E_TRUNCATED));
+				close_section(ctx, t, name);
+				return 1;
+			}
+			data = in->buffer;
+		}
+		if (len > end - in->pos) {
+			len = end - in->pos;
+		}
+		if (in->pos < offset) {
+			long skip = offset - in->pos < len ? offset - in->pos : len;
+			data += skip;
+			len -= skip;
+			in->pos += skip;
+		}
+		if (hash) {
+			hash_update(hash, data, len);
+		}
+		fwrite(data, len, 1, t);
+		in->pos += len;
+	}
+	return close_section(ctx, t, name);
+}
+
+// unpack from a pipe: detect the layout from a lookahead buffer, then stream each section through in order
+static int unpack_stream(struct mboot_ctx *ctx, int fd)
+{
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	long probe_len = 0;
+
+	memset(probe, 0, sizeof(probe));
+	while (probe_len < sizeof(probe)) {
+		ssize_t ret = read(fd, probe + probe_len, sizeof(probe) - probe_len);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			fprintf(stderr, "mboot: cannot read input file '%s': %s\n", ctx->filename, strerror(errno));
+			return 1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		probe_len += ret;
+	}
+
+	// the real size is unknown until the end of the stream, so truncation is caught while copying
+	struct mboot_layout l;
+	int ret = mboot_parse_layout(ctx, probe, LONG_MAX, &l);
+	if (ret) {
+		fprintf(stderr, "mboot: unpacking error: %s\n", mboot_strerror(ret));
+		return 1;
+	}
+
+	struct stream_input in;
+	in.fd = fd;
+	in.probe = probe;
+	in.probe_len = probe_len;
+	in.pos = 0;
+	in.buffer = malloc(PACK_BUFFER_SIZE);
+
+	struct section_writer sections[] = {
+		{ ctx, NULL, 0, l.hdr_size, "hdr", MBOOT_SECTION_HDR },
+		{ ctx, NULL, l.hdr_size, l.sig_size, "sig", MBOOT_SECTION_SIG },
+		{ ctx, NULL, l.parameter_offset, 8, "parameter", MBOOT_SECTION_PARAMETER },
+		{ ctx, NULL, l.bootstub_offset, l.bootstub_size, "bootstub", MBOOT_SECTION_BOOTSTUB },
+		{ ctx, NULL, l.kernel_offset, l.kernel_size, "kernel", MBOOT_SECTION_KERNEL },
+		{ ctx, NULL, l.ramdisk_offset, l.ramdisk_size, "ramdisk.cpio.gz", MBOOT_SECTION_RAMDISK },
+	};
+	int count = sizeof(sections) / sizeof(sections[0]);
+	int i;
+
+	// sections are in stream order, so reading stops right after the last selected one
+	ret = 0;
+	if (selected(ctx, MBOOT_SECTION_CMDLINE)) {
+		ret = write_cmdline(ctx, probe, &l);
+	}
+	for (i = 0; !ret && i < count; i++) {
+		if (!selected(ctx, sections[i].section)) {
+			sections[i].size = 0;
+		}
+		hash_init(&sections[i].hash);
+		if (sections[i].size > 0) {
+			ret = stream_section(ctx, &in, sections[i].offset, sections[i].size, sections[i].name,
+				ctx->manifest ? &sections[i].hash : NULL);
+		}
+	}
+	free(in.buffer);
+	if (ret) {
+		return 1;
+	}
+	if (ctx->manifest && !ctx->output) {
+		for (i = 0; i < count; i++) {
+			hash_final(&sections[i].hash);
+		}
+		if (write_manifest(ctx, probe, &l, sections, count)) {
+			return 1;
+		}
+	}
+
+	print_sizes(ctx, &l);
+	return 0;
+}
+
+int mboot_unpack(struct mboot_ctx *ctx)
+{
+	if (!strcmp(ctx->filename, "-")) {
+#ifdef _WIN32
+		_setmode(STDIN_FILENO, _O_BINARY);
+#endif
+		return unpack_stream(ctx, STDIN_FILENO);
+	}
+
+	FILE *f = fopen(ctx->filename, "rb");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+	if (lseek(fileno(f), 0, SEEK_CUR) == (-1) && errno == ESPIPE) {
+		int ret = unpack_stream(ctx, fileno(f));
+		fclose(f);
+		return ret;
+	}
+
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	struct mboot_layout l;
+	if (mboot_load_layout(ctx, f, probe, &l)) {
+		fclose(f);
+		return 1;
+	}
+	map_image(ctx, f, l.image_end);
+
+	struct section_writer sections[] = {
+		{ ctx, f, 0, l.hdr_size, "hdr", MBOOT_SECTION_HDR },
+		{ ctx, f, l.hdr_size, l.sig_size, "sig", MBOOT_SECTION_SIG },
+		{ ctx, f, l.parameter_offset, 8, "parameter", MBOOT_SECTION_PARAMETER },
+		{ ctx, f, l.bootstub_offset, l.bootstub_size, "bootstub", MBOOT_SECTION_BOOTSTUB },
+		{ ctx, f, l.kernel_offset, l.kernel_size, "kernel", MBOOT_SECTION_KERNEL },
+		{ ctx, f, l.ramdisk_offset, l.ramdisk_size, "ramdisk.cpio.gz", MBOOT_SECTION_RAMDISK },
+	};
+	int count = sizeof(sections) / sizeof(sections[0]);
+	int i;
+
+	// only the requested sections are touched
+	for (i = 0; i < count; i++) {
+		if (!selected(ctx, sections[i].section)) {
+			sections[i].size = 0;
+		}
+		hash_init(&sections[i].hash);
+	}
+
+	// sections are independent once the layout is known, so write the large ones concurrently
+	for (i = 0; i < count; i++) {
+		sections[i].threaded = (sections[i].size >= SECTION_THREAD_MIN &&
+			pthread_create(&sections[i].thread, NULL, section_writer, &sections[i]) == 0);
+	}
+	for (i = 0; i < count; i++) {
+		if (!sections[i].threaded && sections[i].size > 0) {
+			section_writer(&sections[i]);
+		}
+	}
+	int ret = 0;
+	if (selected(ctx, MBOOT_SECTION_CMDLINE)) {
+		ret = write_cmdline(ctx, probe, &l);
+	}
+	for (i = 0; i < count; i++) {
+		if (sections[i].threaded) {
+			pthread_join(sections[i].thread, NULL);
+		}
+		ret |= sections[i].ret;
+	}
+	if (!ret && ctx->manifest && !ctx->output) {
+		for (i = 0; i < count; i++) {
+			hash_final(&sections[i].hash);
+		}
+		ret = write_manifest(ctx, probe, &l, sections, count);
+	}
+	if (!ret) {
+		print_sizes(ctx, &l);
+	}
+
+	unmap_image(ctx);
+	fclose(f);
+	return ret;
+}
+
+// fill the 4096 byte block holding cmdline, image info (kernel and ramdisk sizes), and parameter
+static void build_info_block(unsigned char *block, const void *cmdline, long cmdline_size, const void *parameter,
+	long parameter_size, uint32_t kernel_size, uint32_t ramdisk_size, int sig_present)
+{
+	memset(block, 0, 4096);
+
+	// add parameter padding magic for signed image
+	if (sig_present) {
+		memcpy(block + (1024 + 16), "\xBD\x02\xBD\x02\xBD\x12\xBD\x12", 8);
+	}
+
+	if (cmdline_size > 1024) {
+		cmdline_size = 1024;
+	}
+	if (parameter_size > 4096 - (1024 + 8)) {
+		parameter_size = 4096 - (1024 + 8);
+	}
+	if (cmdline_size > 0) {
+		memcpy(block, cmdline, cmdline_size);
+	}
+	memcpy(block + 1024, &kernel_size, sizeof(kernel_size));
+	memcpy(block + (1024 + 4), &ramdisk_size, sizeof(ramdisk_size));
+	if (parameter_size > 0) {
+		memcpy(block + (1024 + 8), parameter, parameter_size);
+	}
+}
+
+// xor of the first 56 bytes of a header, which is stored in byte 7 when that byte is 0
+static uint8_t header_xor(const unsigned char *hdr)
+{
+	uint8_t xor = 0;
+	int i;
+	for (i = 0; i < 56; i++) {
+		xor ^= hdr[i];
+	}
+	return xor;
+}
+
+// the one checksum rule shared by pack, edit, verify and the OSIP decoding: byte 7 holds the xor of the
+// rest of the first 56 bytes, so all 56 of them xor to zero
+static int header_checksum_ok(const unsigned char *hdr)
+{
+	return header_xor(hdr) == 0;
+}
+
+// adjust header imgtype based on signature presence, then update sector count and xor checksum
+void mboot_finalize_header(unsigned char *hdr, long image_size, int sig_present)
+{
+	if (!sig_present) {
+		uint32_t imgtype;
+		memcpy(&imgtype, hdr + 52, 4);
+		imgtype |= 0x01;
+		memcpy(hdr + 52, &imgtype, 4);
+	}
+
+	uint32_t sectors = (image_size / 512 - 1);
+	memcpy(hdr + 48, &sectors, 4);
+
+	hdr[7] = 0;
+	hdr[7] = header_xor(hdr);
+}
+
+// check an image against what pack would have written for it, without producing any output files
+int mboot_verify(struct mboot_ctx *ctx)
+{
+	FILE *f = fopen(ctx->filename, "rb");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		if (!ctx->quiet) {
+			printf("%s: FAILED\n", ctx->filename);
+		}
+		return 1;
+	}
+
+	// layout detection already rejects kernel and ramdisk sizes that do not fit in the file, which is
+	// a verify failure like any other
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	struct mboot_layout l;
+	int ret = load_layout(ctx, f, probe, &l);
+	fclose(f);
+
+	int failed = 0;
+	if (ret) {
+		// read errors have been reported already
+		if (ret != MBOOT_E_IO) {
+			fprintf(stderr, "mboot: verify: %s\n", mboot_strerror(ret));
+		}
+		failed = 1;
+	} else if (l.hdr_size > 0) {
+		if (!header_checksum_ok(probe)) {
+			fprintf(stderr, "mboot: verify: header checksum is 0x%02x, expected 0x%02x\n", probe[7],
+				header_xor(probe) ^ probe[7]);
+			failed = 1;
+		}
+
+		uint32_t sectors, imgtype;
+		memcpy(&sectors, probe + 48, 4);
+		memcpy(&imgtype, probe + 52, 4);
+		long image_size = (l.ramdisk_offset + l.ramdisk_size + 511) / 512 * 512;
+		if (sectors != image_size / 512 - 1) {
+			fprintf(stderr, "mboot: verify: header sector count is %u, expected %ld\n", sectors, image_size / 512 - 1);
+			failed = 1;
+		}
+		// pack only ever sets bit 0, so a signed image may still carry it from its original header
+		if (l.sig_size == 0 && !(imgtype & 0x01)) {
+			fprintf(stderr, "mboot: verify: header imgtype 0x%08x does not have bit 0 set for a missing signature\n", imgtype);
+			failed = 1;
+		}
+	}
+
+	if (!ctx->quiet) {
+		printf("%s: %s\n", ctx->filename, failed ? "FAILED" : "OK");
+	}
+	return failed;
+}
+
+int mboot_parse_osip(const unsigned char *hdr, long image_size, struct mboot_osip *osip)
+{
+	int i;
+
+	memset(osip, 0, sizeof(*osip));
+	if (memcmp(hdr, "$OS$", 4)) {
+		return MBOOT_E_INVALID;
+	}
+	osip->header_rev_minor = hdr[5];
+	osip->header_rev_major = hdr[6];
+	osip->checksum = hdr[7];
+	osip->num_pointers = hdr[8];
+	osip->num_images = hdr[9];
+	memcpy(&osip->header_size, hdr + 10, 2);
+
+	// checked over the first 56 bytes whatever num_pointers says, as that is all pack ever rewrites
+	osip->count = osip->num_pointers < MBOOT_OSII_MAX ? osip->num_pointers : MBOOT_OSII_MAX;
+	osip->checksum_ok = header_checksum_ok(hdr);
+
+	for (i = 0; i < osip->count; i++) {
+		const unsigned char *d = hdr + 32 + i * 24;
+		struct mboot_osii *e = &osip->entry[i];
+		memcpy(&e->os_rev_minor, d, 2);
+		memcpy(&e->os_rev_major, d + 2, 2);
+		memcpy(&e->logical_start_block, d + 4, 4);
+		memcpy(&e->ddr_load_address, d + 8, 4);
+		memcpy(&e->entry_point, d + 12, 4);
+		memcpy(&e->size_of_os_image, d + 16, 4);
+		e->attribute = d[20];
+
+		// pack copies hdr as it is and never fills in the start block, and block 0 would be the OSIP
+		// header itself, so a start block of 0 is taken to mean the image directly behind the header
+		e->offset = (long)e->logical_start_block * 512;
+		if (e->offset == 0) {
+			e->offset = 512;
+		}
+		e->size = (long)e->size_of_os_image * 512;
+		if (e->offset >= image_size) {
+			e->size = 0;
+		} else if (e->offset + e->size > image_size) {
+			e->size = image_size - e->offset;
+		}
+	}
+	return MBOOT_OK;
+}
+
+int mboot_osip(struct mboot_ctx *ctx, int extract)
+{
+	FILE *f = fopen(ctx->filename, "rb");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+
+	unsigned char hdr[512];
+	struct mboot_osip osip;
+	long size = device_size(fileno(f)) - ctx->base;
+	memset(hdr, 0, sizeof(hdr));
+	if (size < 0 || pread(fileno(f), hdr, sizeof(hdr), ctx->base) < 0) {
+		fprintf(stderr, "mboot: cannot read input file '%s': %s\n", ctx->filename, strerror(errno));
+		fclose(f);
+		return 1;
+	}
+	if (mboot_parse_osip(hdr, size, &osip)) {
+		fprintf(stderr, "mboot: '%s' has no OSIP header\n", ctx->filename);
+		fclose(f);
+		return 1;
+	}
+
+	int i;
+	if (!ctx->quiet) {
+		printf("OSIP rev %u.%u, %u pointers, %u images, header size %u, checksum 0x%02x %s\n",
+			osip.header_rev_major, osip.header_rev_minor, osip.num_pointers, osip.num_images,
+			osip.header_size, osip.checksum, osip.checksum_ok ? "ok" : "bad");
+		printf("%-4s %7s %10s %10s %10s %8s %4s %10s %10s\n",
+			"osii", "rev", "lba", "load", "entry", "sectors", "attr", "offset", "size");
+		for (i = 0; i < osip.count; i++) {
+			struct mboot_osii *e = &osip.entry[i];
+			char rev[16];
+			snprintf(rev, sizeof(rev), "%u.%u", e->os_rev_major, e->os_rev_minor);
+			printf("%-4d %7s %10u 0x%08x 0x%08x %8u 0x%02x %10ld %10ld%s\n", i, rev, e->logical_start_block,
+				e->ddr_load_address, e->entry_point, e->size_of_os_image, e->attribute, e->offset, e->size,
+				e->size < (long)e->size_of_os_image * 512 ? " (truncated)" : "");
+		}
+	}
+	if (!extract) {
+		fclose(f);
+		return 0;
+	}
+
+	// each described image goes to DIR/osiiN.bin, the large ones on their own threads as in unpack
+	struct section_writer writers[MBOOT_OSII_MAX];
+	char names[MBOOT_OSII_MAX][16];
+	memset(writers, 0, sizeof(writers));
+	map_image(ctx, f, size);
+	for (i = 0; i < osip.count; i++) {
+		snprintf(names[i], sizeof(names[i]), "osii%d.bin", i);
+		writers[i].ctx = ctx;
+		writers[i].f = f;
+		writers[i].offset = osip.entry[i].offset;
+		writers[i].size = osip.entry[i].size;
+		writers[i].name = names[i];
+		writers[i].threaded = (writers[i].size >= SECTION_THREAD_MIN &&
+			pthread_create(&writers[i].thread, NULL, section_writer, &writers[i]) == 0);
+	}
+	for (i = 0; i < osip.count; i++) {
+		if (!writers[i].threaded && writers[i].size > 0) {
+			section_writer(&writers[i]);
+		}
+	}
+	int ret = 0;
+	for (i = 0; i < osip.count; i++) {
+		if (writers[i].threaded) {
+			pthread_join(writers[i].thread, NULL);
+		}
+		ret |= writers[i].ret;
+	}
+	unmap_image(ctx);
+	fclose(f);
+	return ret;
+}
+
+long mboot_pack_size(const struct mboot_image *img)
+{
+	long img_size = img->hdr.size + img->sig.size + 4096 + img->bootstub.size + img->kernel.size + img->ramdisk.size;
+	return (img_size + 511) / 512 * 512;
+}
+
+// build hdr, sig and the info block into head and finalize the header for the padded image size
+static long build_head(const struct mboot_image *img, unsigned char *head)
+{
+	long head_size = img->hdr.size + img->sig.size;
+
+	if (img->hdr.data) {
+		memcpy(head, img->hdr.data, img->hdr.size);
+	}
+	if (img->sig.data) {
+		memcpy(head + img->hdr.size, img->sig.data, img->sig.size);
+	}
+	build_info_block(head + head_size, img->cmdline.data, img->cmdline.data ? img->cmdline.size : 0,
+		img->parameter.data, img->parameter.data ? img->parameter.size : 0,
+		img->kernel.size, img->ramdisk.size, img->sig.data != NULL);
+	head_size += 4096;
+
+	if (img->hdr.data) {
+		mboot_finalize_header(head, mboot_pack_size(img), img->sig.data != NULL);
+	}
+	return head_size;
+}
+
+// size of a file in the directory, or -1 if it cannot be accessed
+long mboot_file_size(struct mboot_ctx *ctx, char *name)
+{
+	char inpath[PATH_MAX];
+	struct stat st;
+
+	sprintf(inpath, "%s/%s", ctx->directory, name);
+	if (stat(inpath, &st) == (-1)) {
+		return -1;
+	}
+	return st.st_size;
+}
+
+// read up to max bytes of a small file in the directory into data, returns bytes read or -1
+static int read_file(struct mboot_ctx *ctx, char *name, void *data, unsigned max)
+{
+	char inpath[PATH_MAX];
+
+	sprintf(inpath, "%s/%s", ctx->directory, name);
+	FILE *t = fopen(inpath, "rb");
+	if (!t) {
+		return -1;
+	}
+	int size = fread(data, 1, max, t);
+	fclose(t);
+	return size;
+}
+
+// sector-diff writer: the new image is compared against the existing target one buffer of
+// whole 512 byte sectors at a time, and only runs of changed sectors are written
+struct diff_sink {
+	int fd;
+	long pos;
+	unsigned char *buf;
+	unsigned char *old;
+	long len;
+	long sectors;
+	long written;
+	int error;
+
+	// per-buffer hashes of the new image, kept for the read-back verify
+	uint64_t *hashes;
+	long hash_count;
+};
+
+// where pack writes the image: straight to a stream, or through the diff against the target
+struct pack_output {
+	FILE *f;
+	struct diff_sink *diff;
+};
+
+static uint64_t fnv1a(const unsigned char *data, long len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	long i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void diff_flush(struct diff_sink *d)
+{
+	if (d->len == 0) {
+		return;
+	}
+
+	// whatever the target is missing past its end counts as changed
+	long old_len = pread(d->fd, d->old, d->len, d->pos);
+	if (old_len < 0) {
+		old_len = 0;
+	}
+
+	long i, run = -1;
+	for (i = 0; i <= d->len; i += 512) {
+		int changed = (i < d->len) && (i + 512 > old_len || memcmp(d->buf + i, d->old + i, 512));
+		if (changed && run < 0) {
+			run = i;
+		} else if (!changed && run >= 0) {
+			if (pwrite(d->fd, d->buf + run, i - run, d->pos + run) != i - run) {
+				d->error = 1;
+			}
+			d->written += (i - run) / 512;
+			run = -1;
+		}
+	}
+	d->sectors += d->len / 512;
+
+	d->hashes = realloc(d->hashes, sizeof(uint64_t) * (d->hash_count + 1));
+	d->hashes[d->hash_count++] = fnv1a(d->buf, d->len);
+	d->pos += d->len;
+	d->len = 0;
+}
+
+static void diff_write(struct diff_sink *d, const unsigned char *data, long len)
+{
+	while (len > 0) {
+		long n = PACK_BUFFER_SIZE - d->len < len ? PACK_BUFFER_SIZE - d->len : len;
+		memcpy(d->buf + d->len, data, n);
+		d->len += n;
+		data += n;
+		len -= n;
+		if (d->len == PACK_BUFFER_SIZE) {
+			diff_flush(d);
+		}
+	}
+}
+
+// read the target back bypassing the page cache and compare it with what was meant to be written
+static int diff_verify(struct diff_sink *d, char *target)
+{
+	int fd = -1;
+#ifdef O_DIRECT
+	fd = open(target, O_RDONLY | O_DIRECT);
+#endif
+	if (fd < 0) {
+		// filesystems without O_DIRECT still get a read-back, just not an uncached one
+		fd = open(target, O_RDONLY);
+	}
+	if (fd < 0) {
+		return 1;
+	}
+
+	void *buf = NULL;
+#ifndef _WIN32
+	if (posix_memalign(&buf, 4096, PACK_BUFFER_SIZE)) {
+		buf = NULL;
+	}
+#else
+	buf = malloc(PACK_BUFFER_SIZE);
+#endif
+	int ret = !buf;
+	long i;
+	for (i = 0; !ret && i < d->hash_count; i++) {
+		long len = i < d->hash_count - 1 ? PACK_BUFFER_SIZE : d->pos - i * PACK_BUFFER_SIZE;
+		long got = pread(fd, buf, (len + 4095) / 4096 * 4096, i * PACK_BUFFER_SIZE);
+		ret = (got < len || fnv1a(buf, len) != d->hashes[i]);
+	}
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+static void output_write(struct pack_output *out, const void *data, long len)
+{
+	if (out->diff) {
+		diff_write(out->diff, data, len);
+	} else {
+		fwrite(data, len, 1, out->f);
+	}
+}
+
+// copy an open component to the end of out, in the kernel where possible and
+// otherwise through a fixed-size buffer, returns bytes written
+static long append_file(struct mboot_ctx *ctx, struct pack_output *out, FILE *t)
+{
+	// let the kernel copy or reflink as much as it can before falling back to the buffer
+	struct stat st;
+	long size = 0;
+	if (!out->diff && fstat(fileno(t), &st) == 0 && S_ISREG(st.st_mode)) {
+		fflush(out->f);
+		long offset = ftell(out->f);
+		size = mboot_copy_range(ctx, fileno(t), 0, fileno(out->f), st.st_size);
+		if (offset >= 0) {
+			fseek(out->f, offset + size, SEEK_SET);
+		}
+		fseek(t, size, SEEK_SET);
+	}
+
+	unsigned char *buffer = malloc(PACK_BUFFER_SIZE);
+	size_t len;
+	while ((len = fread(buffer, 1, PACK_BUFFER_SIZE, t)) > 0) {
+		output_write(out, buffer, len);
+		size += len;
+	}
+	free(buffer);
+	return size;
+}
+
+// bounded ring of chunks between the component reader thread and the image writer
+struct pack_pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *chunk[PIPELINE_CHUNKS];
+	long len[PIPELINE_CHUNKS];
+	long produced;
+	long consumed;
+	int error;
+
+	FILE *inputs[3];
+	int count;
+};
+
+// reader stage: prefetch every pipelined component in order, never getting more than the ring ahead of the writer
+static void *pipeline_reader(void *arg)
+{
+	struct pack_pipeline *p = arg;
+	int i;
+
+	for (i = 0; i < p->count; i++) {
+		for (;;) {
+			pthread_mutex_lock(&p->lock);
+			while (p->produced - p->consumed == PIPELINE_CHUNKS && !p->error) {
+				pthread_cond_wait(&p->cond, &p->lock);
+			}
+			int stop = p->error;
+			int slot = p->produced % PIPELINE_CHUNKS;
+			pthread_mutex_unlock(&p->lock);
+			if (stop) {
+				return NULL;
+			}
+
+			// a chunk never spans two components so the writer can tell where each one ends
+			long len = fread(p->chunk[slot], 1, PIPELINE_CHUNK_SIZE, p->inputs[i]);
+			if (len == 0) {
+				break;
+			}
+			pthread_mutex_lock(&p->lock);
+			p->len[slot] = len;
+			p->produced++;
+			pthread_cond_broadcast(&p->cond);
+			pthread_mutex_unlock(&p->lock);
+		}
+	}
+
+	// an empty chunk marks the end of the input
+	pthread_mutex_lock(&p->lock);
+	while (p->produced - p->consumed == PIPELINE_CHUNKS && !p->error) {
+		pthread_cond_wait(&p->cond, &p->lock);
+	}
+	p->len[p->produced % PIPELINE_CHUNKS] = 0;
+	p->produced++;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+// writer stage: copy the next size bytes that the reader has prefetched to out
+static long pipeline_write(struct pack_pipeline *p, struct pack_output *out, long size)
+{
+	long done = 0;
+
+	while (done < size) {
+		pthread_mutex_lock(&p->lock);
+		while (p->produced == p->consumed) {
+			pthread_cond_wait(&p->cond, &p->lock);
+		}
+		int slot = p->consumed % PIPELINE_CHUNKS;
+		pthread_mutex_unlock(&p->lock);
+
+		long len = p->len[slot];
+		if (len == 0 || done + len > size) {
+			break;
+		}
+		output_write(out, p->chunk[slot], len);
+		done += len;
+
+		pthread_mutex_lock(&p->lock);
+		p->consumed++;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+	return done;
+}
+
+static void pipeline_stop(struct pack_pipeline *p, pthread_t reader)
+{
+	pthread_mutex_lock(&p->lock);
+	p->error = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+	pthread_join(reader, NULL);
+}
+
+static FILE *open_file(struct mboot_ctx *ctx, char *name)
+{
+	char inpath[PATH_MAX];
+
+	sprintf(inpath, "%s/%s", ctx->directory, name);
+	return fopen(inpath, "rb");
+}
+
+int mboot_pack(struct mboot_ctx *ctx)
+{
+	// check the required files up front since their sizes go into the image info block
+	char *required_file[] = { "cmdline.txt", "parameter", "bootstub", "kernel", "ramdisk.cpio.gz" };
+	long required_size[5];
+	int i;
+	for (i = 0; i < (sizeof(required_file) / sizeof(required_file[0])); i++) {
+		required_size[i] = mboot_file_size(ctx, required_file[i]);
+		if (required_size[i] < 0) {
+			fprintf(stderr, "mboot: cannot open input file '%s': %s\n", required_file[i], strerror(errno));
+			return 1;
+		}
+	}
+
+	FILE *f;
+	struct diff_sink diff;
+	struct pack_output out = { NULL, NULL };
+	if (!strcmp(ctx->filename, "-")) {
+		if (ctx->diff_write) {
+			fprintf(stderr, "mboot: --diff-write needs an output file or block device\n");
+			return 1;
+		}
+#ifdef _WIN32
+		_setmode(STDOUT_FILENO, _O_BINARY);
+#endif
+		f = stdout;
+	} else if (ctx->diff_write) {
+		// keep the existing target contents so they can be compared against
+		int fd = open(ctx->filename, O_RDWR | O_CREAT, 0644);
+		f = fd < 0 ? NULL : fdopen(fd, "r+b");
+	} else {
+		f = fopen(ctx->filename, "wb");
+	}
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open output file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+	out.f = f;
+	if (ctx->diff_write) {
+		memset(&diff, 0, sizeof(diff));
+		diff.fd = fileno(f);
+		diff.buf = malloc(PACK_BUFFER_SIZE);
+		diff.old = malloc(PACK_BUFFER_SIZE);
+		out.diff = &diff;
+	}
+	struct stat out_st;
+	int out_regular = (fstat(fileno(f), &out_st) == 0 && S_ISREG(out_st.st_mode));
+
+	// bootstub, kernel and ramdisk on the output's filesystem are copied or reflinked by the kernel,
+	// the rest are prefetched by a reader thread while the leading sections are written
+	FILE *payload[3];
+	int pipelined[3];
+	struct pack_pipeline p;
+	memset(&p, 0, sizeof(p));
+	for (i = 0; i < 3; i++) {
+		payload[i] = open_file(ctx, required_file[i + 2]);
+		if (!payload[i]) {
+			fprintf(stderr, "mboot: cannot open input file '%s': %s\n", required_file[i + 2], strerror(errno));
+			while (i--) {
+				fclose(payload[i]);
+			}
+			fclose(f);
+			return 1;
+		}
+		struct stat st;
+		pipelined[i] = ctx->diff_write || !(out_regular && fstat(fileno(payload[i]), &st) == 0 && st.st_dev == out_st.st_dev);
+		if (pipelined[i]) {
+			p.inputs[p.count++] = payload[i];
+		}
+	}
+	pthread_t reader;
+	if (p.count > 0) {
+		pthread_mutex_init(&p.lock, NULL);
+		pthread_cond_init(&p.cond, NULL);
+		for (i = 0; i < PIPELINE_CHUNKS; i++) {
+			p.chunk[i] = malloc(PIPELINE_CHUNK_SIZE);
+		}
+		if (pthread_create(&reader, NULL, pipeline_reader, &p)) {
+			memset(pipelined, 0, sizeof(pipelined));
+			p.count = 0;
+		}
+	}
+
+	// every size is known now, so the header can be finalized before the first byte is written
+	struct mboot_image img;
+	memset(&img, 0, sizeof(img));
+	long hdr_size = mboot_file_size(ctx, "hdr");
+	long sig_size = mboot_file_size(ctx, "sig");
+	unsigned char *hdr_data = malloc(hdr_size > 0 ? hdr_size : 1);
+	unsigned char *sig_data = malloc(sig_size > 0 ? sig_size : 1);
+	if (hdr_size >= 0) {
+		img.hdr.data = hdr_data;
+		img.hdr.size = read_file(ctx, "hdr", hdr_data, hdr_size);
+	}
+	if (sig_size >= 0) {
+		img.sig.data = sig_data;
+		img.sig.size = read_file(ctx, "sig", sig_data, sig_size);
+	}
+
+	unsigned char cmdline[1024];
+	unsigned char parameter[4096 - (1024 + 8)];
+	int cmdline_size = read_file(ctx, "cmdline.txt", cmdline, sizeof(cmdline));
+	int parameter_size = read_file(ctx, "parameter", parameter, sizeof(parameter));
+	img.cmdline.data = cmdline;
+	img.cmdline.size = cmdline_size > 0 ? cmdline_size : 0;
+	img.parameter.data = parameter;
+	img.parameter.size = parameter_size > 0 ? parameter_size : 0;
+	img.bootstub.size = required_size[2];
+	img.kernel.size = required_size[3];
+	img.ramdisk.size = required_size[4];
+
+	unsigned char *head = malloc(img.hdr.size + img.sig.size + 4096);
+	long head_size = build_head(&img, head);
+	free(hdr_data);
+	free(sig_data);
+
+	// add header, signature and the cmdline/image info/parameter block
+	output_write(&out, head, head_size);
+	free(head);
+
+	// add bootstub, kernel and ramdisk
+	long img_size = head_size;
+	int ret = 0;
+	for (i = 0; i < 3; i++) {
+		long size = pipelined[i] ? pipeline_write(&p, &out, required_size[i + 2]) : append_file(ctx, &out, payload[i]);
+		if (size != required_size[i + 2]) {
+			fprintf(stderr, "mboot: cannot read input file '%s': %s\n", required_file[i + 2], strerror(errno));
+			ret = 1;
+			break;
+		}
+		img_size += size;
+	}
+
+	if (p.count > 0) {
+		pipeline_stop(&p, reader);
+		pthread_mutex_destroy(&p.lock);
+		pthread_cond_destroy(&p.cond);
+	}
+	for (i = 0; i < PIPELINE_CHUNKS; i++) {
+		free(p.chunk[i]);
+	}
+	for (i = 0; i < 3; i++) {
+		fclose(payload[i]);
+	}
+
+	// add trailing padding to the next full 512 byte sector
+	if (!ret) {
+		unsigned char padding[512];
+		long padding_size = mboot_pack_size(&img) - img_size;
+		memset(padding, (int)'\xFF', padding_size);
+		output_write(&out, padding, padding_size);
+	}
+
+	if (!ret && out.diff) {
+		diff_flush(&diff);
+
+		// a stale tail would otherwise survive in a regular file target, a block device keeps its size
+		if (out_regular && ftruncate(diff.fd, diff.pos) == (-1)) {
+			diff.error = 1;
+		}
+		if (diff.error || fsync(diff.fd) == (-1)) {
+			fprintf(stderr, "mboot: cannot write output file '%s': %s\n", ctx->filename, strerror(errno));
+			ret = 1;
+		} else if (!ctx->quiet) {
+			printf("diff-write    %ld of %ld sectors written\n", diff.written, diff.sectors);
+		}
+		if (!ret && ctx->verify_write) {
+			ret = diff_verify(&diff, ctx->filename);
+			if (ret) {
+				fprintf(stderr, "mboot: verify failed: '%s' does not match the packed image\n", ctx->filename);
+			}
+		}
+	}
+	if (out.diff) {
+		free(diff.buf);
+		free(diff.old);
+		free(diff.hashes);
+	}
+
+	if (fclose(f) && !ret) {
+		fprintf(stderr, "mboot: cannot write output file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+	return ret;
+}
+
+
+// copy a range of in to the end of out, in the kernel where possible and otherwise through a fixed-size buffer
+static long append_range(struct mboot_ctx *ctx, FILE *out, int in, long offset, long size)
+{
+	fflush(out);
+	long out_offset = ftell(out);
+	long done = mboot_copy_range(ctx, in, offset, fileno(out), size);
+	if (out_offset >= 0) {
+		fseek(out, out_offset + done, SEEK_SET);
+	}
+
+	unsigned char *buffer = malloc(PACK_BUFFER_SIZE);
+	while (done < size) {
+		long len = size - done < PACK_BUFFER_SIZE ? size - done : PACK_BUFFER_SIZE;
+		len = pread(in, buffer, len, offset + done);
+		if (len <= 0) {
+			break;
+		}
+		fwrite(buffer, len, 1, out);
+		done += len;
+	}
+	free(buffer);
+	return done;
+}
+
+// write a copy of the base image ctx->filename to ctx->output with its kernel and/or ramdisk
+// replaced by the given files, copying every unchanged range straight from the base
+int mboot_replace(struct mboot_ctx *ctx, const char *kernel, const char *ramdisk)
+{
+	FILE *f = fopen(ctx->filename, "rb");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	struct mboot_layout l;
+	if (mboot_load_layout(ctx, f, probe, &l)) {
+		fclose(f);
+		return 1;
+	}
+
+	// each payload comes either from its replacement file or from its range in the base image
+	const char *path[2] = { kernel, ramdisk };
+	int fd[2] = { fileno(f), fileno(f) };
+	long offset[2] = { l.kernel_offset, l.ramdisk_offset };
+	long size[2] = { l.kernel_size, l.ramdisk_size };
+	FILE *t[2] = { NULL, NULL };
+	int ret = 0;
+	int i;
+	for (i = 0; i < 2; i++) {
+		struct stat st;
+		if (!path[i]) {
+			continue;
+		}
+		t[i] = fopen(path[i], "rb");
+		if (!t[i] || fstat(fileno(t[i]), &st) == (-1)) {
+			fprintf(stderr, "mboot: cannot open input file '%s': %s\n", path[i], strerror(errno));
+			ret = 1;
+			break;
+		}
+		fd[i] = fileno(t[i]);
+		offset[i] = 0;
+		size[i] = st.st_size;
+	}
+
+	struct mboot_image img;
+	memset(&img, 0, sizeof(img));
+	img.hdr.size = l.hdr_size;
+	img.sig.size = l.sig_size;
+	img.bootstub.size = l.bootstub_size;
+	img.kernel.size = size[0];
+	img.ramdisk.size = size[1];
+
+	FILE *out = NULL;
+	if (!ret) {
+		if (!strcmp(ctx->output, "-")) {
+#ifdef _WIN32
+			_setmode(STDOUT_FILENO, _O_BINARY);
+#endif
+			out = stdout;
+		} else {
+			struct stat in_st, out_st;
+			if (stat(ctx->output, &out_st) == 0 && fstat(fileno(f), &in_st) == 0 &&
+				in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+				fprintf(stderr, "mboot: output file '%s' is the base image\n", ctx->output);
+				ret = 1;
+			} else {
+				out = fopen(ctx->output, "wb");
+			}
+		}
+		if (!ret && !out) {
+			fprintf(stderr, "mboot: cannot open output file '%s': %s\n", ctx->output, strerror(errno));
+			ret = 1;
+		}
+	}
+
+	if (!ret) {
+		// only the size fields and the header change in the leading sections
+		long head_size = l.bootstub_offset;
+		unsigned char *head = malloc(head_size);
+		if (pread(fileno(f), head, head_size, 0) != head_size) {
+			fprintf(stderr, "mboot: cannot read input file '%s': %s\n", ctx->filename, strerror(errno));
+			ret = 1;
+		} else {
+			uint32_t kernel_size = size[0];
+			uint32_t ramdisk_size = size[1];
+			memcpy(head + l.cmdline_offset + 1024, &kernel_size, sizeof(kernel_size));
+			memcpy(head + l.cmdline_offset + (1024 + 4), &ramdisk_size, sizeof(ramdisk_size));
+			if (l.hdr_size > 0) {
+				mboot_finalize_header(head, mboot_pack_size(&img), l.sig_size > 0);
+			}
+			fwrite(head, head_size, 1, out);
+		}
+		free(head);
+	}
+
+	long img_size = l.bootstub_offset;
+	if (!ret) {
+		ret = (append_range(ctx, out, fileno(f), l.bootstub_offset, l.bootstub_size) != l.bootstub_size);
+		img_size += l.bootstub_size;
+	}
+	for (i = 0; !ret && i < 2; i++) {
+		if (append_range(ctx, out, fd[i], offset[i], size[i]) != size[i]) {
+			fprintf(stderr, "mboot: cannot read input file '%s': %s\n", path[i] ? path[i] : ctx->filename, strerror(errno));
+			ret = 1;
+		}
+		img_size += size[i];
+	}
+
+	// add trailing padding to the next full 512 byte sector
+	if (!ret) {
+		unsigned char padding[512];
+		long padding_size = mboot_pack_size(&img) - img_size;
+		memset(padding, (int)'\xFF', padding_size);
+		fwrite(padding, padding_size, 1, out);
+	}
+
+	if (out == stdout) {
+		fflush(out);
+	} else if (out && fclose(out) && !ret) {
+		fprintf(stderr, "mboot: cannot write output file '%s': %s\n", ctx->output, strerror(errno));
+		ret = 1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (t[i]) {
+			fclose(t[i]);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+// patch the cmdline and parameter of an existing image with pwrite and refresh its header in place
+int mboot_edit(struct mboot_ctx *ctx, const char *cmdline)
+{
+	unsigned char block[1024];
+	unsigned char parameter[8];
+	int cmdline_size;
+
+	memset(block, 0, sizeof(block));
+	if (cmdline) {
+		cmdline_size = strlen(cmdline) < sizeof(block) ? strlen(cmdline) : sizeof(block);
+		memcpy(block, cmdline, cmdline_size);
+	} else {
+		cmdline_size = read_file(ctx, "cmdline.txt", block, sizeof(block));
+	}
+	int parameter_size = read_file(ctx, "parameter", parameter, sizeof(parameter));
+	if (cmdline_size < 0 && parameter_size <= 0) {
+		fprintf(stderr, "mboot: nothing to edit, no cmdline.txt or parameter in '%s'\n", ctx->directory);
+		return 1;
+	}
+
+	FILE *f = fopen(ctx->filename, "r+b");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	struct mboot_layout l;
+	if (mboot_load_layout(ctx, f, probe, &l)) {
+		fclose(f);
+		return 1;
+	}
+
+	int fd = fileno(f);
+	int ret = 0;
+	if (cmdline_size >= 0 && pwrite(fd, block, sizeof(block), l.cmdline_offset) != sizeof(block)) {
+		ret = 1;
+	}
+	if (!ret && parameter_size > 0 && pwrite(fd, parameter, parameter_size, l.parameter_offset) != parameter_size) {
+		ret = 1;
+	}
+
+	// recompute imgtype, sector count and xor checksum the same way pack does
+	if (!ret && l.hdr_size > 0) {
+		struct mboot_image img;
+		memset(&img, 0, sizeof(img));
+		img.hdr.size = l.hdr_size;
+		img.sig.size = l.sig_size;
+		img.bootstub.size = l.bootstub_size;
+		img.kernel.size = l.kernel_size;
+		img.ramdisk.size = l.ramdisk_size;
+
+		unsigned char hdr[56];
+		if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			ret = 1;
+		} else {
+			mboot_finalize_header(hdr, mboot_pack_size(&img), l.sig_size > 0);
+			ret = (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr));
+		}
+	}
+	if (ret) {
+		fprintf(stderr, "mboot: cannot write output file '%s': %s\n", ctx->filename, strerror(errno));
+	}
+	fclose(f);
+	return ret;
+}
+
+// first offset in [start, end) where "$OS$" begins, or -1; SSE2 compares the first and last '$'
+// of 16 positions at once so only real candidates reach memcmp
+static long find_osip(const unsigned char *buf, long start, long end)
+{
+	long i = start;
+
+#ifdef __SSE2__
+	const __m128i dollar = _mm_set1_epi8('$');
+	for (; i + 16 + 3 <= end; i += 16) {
+		__m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), dollar);
+		__m128i last = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 3)), dollar);
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(first, last));
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (!memcmp(buf + i + bit, "$OS$", 4)) {
+				return i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i + 4 <= end; i++) {
+		if (!memcmp(buf + i, "$OS$", 4)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int mboot_find(struct mboot_ctx *ctx, int extract)
+{
+	FILE *f = fopen(ctx->filename, "rb");
+	if (!f) {
+		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+		return 1;
+	}
+
+	long size = device_size(fileno(f));
+	ctx->base = 0;
+	map_image(ctx, f, size);
+	const unsigned char *dump = ctx->image_map;
+	if (!dump) {
+		fprintf(stderr, "mboot: cannot map input file '%s'\n", ctx->filename);
+		fclose(f);
+		return 1;
+	}
+
+	int found = 0;
+	int failed = 0;
+	long offset = 0;
+	while ((offset = find_osip(dump, offset, size)) >= 0) {
+		unsigned char probe[MBOOT_PROBE_SIZE];
+		struct mboot_layout l;
+		long avail = size - offset;
+
+		// the header checksum has to hold the way pack writes it and the blocks behind it have to make
+		// a whole image, only the probe is copied out of the dump to be zero padded like any other
+		memset(probe, 0, sizeof(probe));
+		memcpy(probe, dump + offset, avail < MBOOT_PROBE_SIZE ? avail : MBOOT_PROBE_SIZE);
+		if (avail < 512 || !header_checksum_ok(probe) ||
+			mboot_parse_layout(ctx, probe, avail, &l) || l.hdr_size != 512) {
+			offset++;
+			continue;
+		}
+
+		found++;
+		if (!ctx->quiet) {
+			printf("0x%08lx  sig %4ld  bootstub %4ld  kernel %8u  ramdisk %9u  end 0x%08lx  confidence %d\n",
+				offset, l.sig_size, l.bootstub_size, l.kernel_size, l.ramdisk_size, offset + l.image_end, l.confidence);
+		}
+
+		// each hit is unpacked straight out of the dump into its own DIR/0xOFFSET directory
+		if (extract) {
+			struct mboot_ctx hit = *ctx;
+			char dir[PATH_MAX];
+			snprintf(dir, sizeof(dir), "%s/0x%08lx", ctx->directory, offset);
+#ifdef _WIN32
+			mkdir(dir);
+#else
+			mkdir(dir, 0755);
+#endif
+			hit.directory = dir;
+			hit.base = offset;
+			hit.quiet = 1;
+			hit.image_map = NULL;
+			hit.image_map_size = 0;
+			if (mboot_unpack(&hit)) {
+				failed = 1;
+			}
+		}
+
+		// images do not overlap, so carry on behind this one
+		offset += l.image_end;
+	}
+
+	if (!found) {
+		fprintf(stderr, "mboot: no boot image found in '%s'\n", ctx->filename);
+		failed = 1;
+	}
+	unmap_image(ctx);
+	fclose(f);
+	return failed;
+}
+
+// depth of one scan batch, each file in it gets a MBOOT_PROBE_SIZE buffer
+#define SCAN_BATCH 64
+
+// one file of a scan: where it is, and the leading bytes read from it
+struct scan_entry {
+	char *path;
+	int fd;
+	long size;
+	long len;
+	int err;
+	unsigned char *probe;
+
+	// identity and cached layout when a layout cache is in use
+	struct cache_entry key;
+	int keyed;
+	int cached;
+};
+
+// collect every regular file under dir, not following directory symlinks
+static int scan_walk(const char *dir, char ***paths, int *count)
+{
+	DIR *d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "mboot: cannot open directory '%s': %s\n", dir, strerror(errno));
+		return 1;
+	}
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		char path[PATH_MAX];
+		struct stat st;
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		// d_type saves a stat() per entry where the platform has it (mingw has neither it nor the DT_
+		// constants), symlinks are followed to files but not to directories
+		enum { WALK_UNKNOWN, WALK_LINK, WALK_FILE, WALK_DIR, WALK_OTHER } type = WALK_UNKNOWN;
+#ifdef DT_UNKNOWN
+		if (de->d_type == DT_LNK) {
+			type = WALK_LINK;
+		} else if (de->d_type == DT_REG) {
+			type = WALK_FILE;
+		} else if (de->d_type == DT_DIR) {
+			type = WALK_DIR;
+		} else if (de->d_type != DT_UNKNOWN) {
+			type = WALK_OTHER;
+		}
+#elif !defined(_WIN32)
+		if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
+			type = WALK_LINK;
+		}
+#endif
+		if (type == WALK_UNKNOWN || type == WALK_LINK) {
+			if (stat(path, &st) == (-1)) {
+				continue;
+			}
+			if (S_ISREG(st.st_mode)) {
+				type = WALK_FILE;
+			} else if (S_ISDIR(st.st_mode) && type == WALK_UNKNOWN) {
+				type = WALK_DIR;
+			} else {
+				continue;
+			}
+		}
+		if (type == WALK_DIR) {
+			scan_walk(path, paths, count);
+		} else if (type == WALK_FILE) {
+			*paths = realloc(*paths, sizeof(char *) * (*count + 1));
+			(*paths)[(*count)++] = strdup(path);
+		}
+	}
+	closedir(d);
+	return 0;
+}
+
+static int scan_path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// plain open/read/close of one file, for kernels without io_uring and other platforms
+static void scan_read_sync(struct scan_entry *e)
+{
+	int fd = open(e->path, O_RDONLY);
+	if (fd < 0) {
+		e->err = errno;
+		return;
+	}
+	e->size = device_size(fd);
+	e->len = pread(fd, e->probe, MBOOT_PROBE_SIZE, 0);
+	if (e->len < 0) {
+		e->err = errno;
+	}
+	close(fd);
+}
+
+#ifdef HAVE_IO_URING
+// just enough of an io_uring to submit a batch and wait for all of it, set up with raw syscalls
+struct uring {
+	int fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_size;
+	size_t cq_map_size;
+	size_t sqes_size;
+	unsigned queued;
+};
+
+static int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) {
+		return -1;
+	}
+
+	// openat, statx, read and close all arrived together with IORING_FEAT_RW_CUR_POS
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(r->fd);
+		return -1;
+	}
+
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (r->cq_map_size > r->sq_map_size) {
+		r->sq_map_size = r->cq_map_size;
+	}
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sq_map != MAP_FAILED) {
+			munmap(r->sq_map, r->sq_map_size);
+		}
+		close(r->fd);
+		return -1;
+	}
+	r->cq_map = r->sq_map;
+
+	unsigned char *sq = r->sq_map;
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned *)(sq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r, int op, int fd, unsigned long long user_data)
+{
+	unsigned tail = *r->sq_tail + r->queued++;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	r->sq_array[index] = index;
+	return sqe;
+}
+
+// submit everything queued and store each completion's result at results[user_data]
+static int uring_run(struct uring *r, int *results)
+{
+	unsigned count = r->queued;
+	unsigned submitted = 0;
+	unsigned reaped = 0;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + count, __ATOMIC_RELEASE);
+	r->queued = 0;
+	while (reaped < count) {
+		int ret = syscall(__NR_io_uring_enter, r->fd, count - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		}
+		submitted += ret;
+
+		unsigned head = *r->cq_head;
+		unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++, reaped++) {
+			struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			results[cqe->user_data] = cqe->res;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+// open and stat every file of the batch in one submission, then read and close them all in a second one
+static int scan_read_uring(struct uring *r, struct scan_entry **batch, int count)
+{
+	struct statx stx[SCAN_BATCH];
+	int results[SCAN_BATCH * 2];
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_OPENAT, AT_FDCWD, i * 2);
+		sqe->addr = (unsigned long)batch[i]->path;
+		sqe->open_flags = O_RDONLY;
+		sqe = uring_sqe(r, IORING_OP_STATX, AT_FDCWD, i * 2 + 1);
+		sqe->addr = (unsigned long)batch[i]->path;
+		sqe->addr2 = (unsigned long)&stx[i];
+		sqe->len = STATX_SIZE;
+	}
+	if (uring_run(r, results)) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		batch[i]->fd = results[i * 2];
+		batch[i]->size = stx[i].stx_size;
+		if (batch[i]->fd < 0) {
+			batch[i]->err = -batch[i]->fd;
+			continue;
+		}
+		if (results[i * 2 + 1] < 0) {
+			batch[i]->err = -results[i * 2 + 1];
+		}
+
+		// the close runs after the read whatever its result
+		struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_READ, batch[i]->fd, i * 2);
+		sqe->addr = (unsigned long)batch[i]->probe;
+		sqe->len = MBOOT_PROBE_SIZE;
+		sqe->off = 0;
+		sqe->flags = IOSQE_IO_HARDLINK;
+		uring_sqe(r, IORING_OP_CLOSE, batch[i]->fd, i * 2 + 1);
+	}
+	if (uring_run(r, results)) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (batch[i]->fd < 0) {
+			continue;
+		}
+		batch[i]->len = results[i * 2];
+		if (batch[i]->len < 0 && !batch[i]->err) {
+			batch[i]->err = -batch[i]->len;
+		}
+		if (results[i * 2 + 1] == -ECANCELED) {
+			close(batch[i]->fd);
+		}
+	}
+	return 0;
+}
+#endif
+
+static void scan_print(struct mboot_ctx *ctx, struct scan_entry *e, int jsonl)
+{
+	struct mboot_layout l;
+	const char *status = "ok";
+
+	memset(&l, 0, sizeof(l));
+	if (e->cached) {
+		l = e->key.l;
+		e->size = l.image_size;
+	} else if (e->err) {
+		status = strerror(e->err);
+	} else {
+		// a short file leaves the rest of the probe zeroed, as layout detection expects
+		memset(e->probe + e->len, 0, MBOOT_PROBE_SIZE - e->len);
+		int ret = mboot_parse_layout(ctx, e->probe, e->size, &l);
+		if (ret) {
+			status = mboot_strerror(ret);
+		} else if (e->keyed) {
+			cache_store(ctx->cache, &e->key, &l);
+		}
+	}
+
+	if (jsonl) {
+		printf("{\"file\": ");
+		mboot_json_string(stdout, e->path);
+		printf(", \"image_size\": %ld, \"hdr_size\": %ld, \"sig_size\": %ld, \"bootstub_size\": %ld, "
+			"\"kernel_size\": %u, \"ramdisk_size\": %u, \"confidence\": %d, \"runner_up\": %d, \"status\": ",
+			e->size, l.hdr_size, l.sig_size, l.bootstub_size, l.kernel_size, l.ramdisk_size, l.confidence, l.runner_up);
+		mboot_json_string(stdout, status);
+		printf("}\n");
+	} else if (e->err) {
+		printf("%-4s %5s %8s %10s %10s %4s  %-24s %s\n", "-", "-", "-", "-", "-", "-", status, e->path);
+	} else {
+		printf("%-4s %5ld %8ld %10u %10u %4d  %-24s %s\n", l.hdr_size ? "yes" : "no", l.sig_size, l.bootstub_size,
+			l.kernel_size, l.ramdisk_size, l.confidence, status, e->path);
+	}
+}
+
+int mboot_scan(struct mboot_ctx *ctx, const char *dir, int jsonl)
+{
+	char **paths = NULL;
+	int count = 0;
+	int i, j;
+
+	if (scan_walk(dir, &paths, &count)) {
+		return 1;
+	}
+	qsort(paths, count, sizeof(char *), scan_path_cmp);
+
+	struct scan_entry batch[SCAN_BATCH];
+	struct scan_entry *reads[SCAN_BATCH];
+	unsigned char *probes = malloc((long)SCAN_BATCH * MBOOT_PROBE_SIZE);
+	int ring = 0;
+#ifdef HAVE_IO_URING
+	struct uring r;
+	ring = uring_init(&r, SCAN_BATCH * 2) == 0;
+#endif
+	if (ctx->debug) {
+		printf("scan: %d files, %s\n", count, ring ? "io_uring" : "synchronous reads");
+	}
+	if (!jsonl) {
+		printf("%-4s %5s %8s %10s %10s %4s  %-24s %s\n", "hdr", "sig", "bootstub", "kernel", "ramdisk", "conf", "status",
+			"file");
+	}
+
+	int failed = 0;
+	for (i = 0; i < count; i += SCAN_BATCH) {
+		int n = count - i < SCAN_BATCH ? count - i : SCAN_BATCH;
+		int misses = 0;
+		memset(batch, 0, sizeof(batch));
+		for (j = 0; j < n; j++) {
+			struct stat st;
+			batch[j].path = paths[i + j];
+			batch[j].fd = -1;
+			batch[j].probe = probes + (long)j * MBOOT_PROBE_SIZE;
+
+			// with a warm cache a file costs one stat and is never opened
+			if (ctx->cache && stat(batch[j].path, &st) == 0 && !cache_key(ctx, &st, &batch[j].key)) {
+				batch[j].keyed = 1;
+				batch[j].cached = cache_lookup(ctx->cache, &batch[j].key, &batch[j].key.l);
+			}
+			if (!batch[j].cached) {
+				reads[misses++] = &batch[j];
+			}
+		}
+
+#ifdef HAVE_IO_URING
+		if (ring && misses && scan_read_uring(&r, reads, misses)) {
+			fprintf(stderr, "mboot: scan: io_uring failed: %s\n", strerror(errno));
+			failed = 1;
+			break;
+		}
+#endif
+		for (j = 0; j < misses; j++) {
+			if (!ring) {
+				scan_read_sync(reads[j]);
+			}
+		}
+		for (j = 0; j < n; j++) {
+			scan_print(ctx, &batch[j], jsonl);
+		}
+	}
+
+#ifdef HAVE_IO_URING
+	if (ring) {
+		uring_exit(&r);
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		free(paths[i]);
+	}
+	free(paths);
+	free(probes);
+	return failed;
+}
+
+// split an image into section views pointing into it, nothing is copied
+int mboot_unpack_mem(const void *image, size_t size, struct mboot_image *img)
+{
+	const unsigned char *base = image;
+	unsigned char probe[MBOOT_PROBE_SIZE];
+
+	memset(img, 0, sizeof(*img));
+	if (!image) {
+		return MBOOT_E_INVALID;
+	}
+
+	// detection expects a full probe window, so only short images are copied and zero filled
+	const unsigned char *p = base;
+	if (size < MBOOT_PROBE_SIZE) {
+		memset(probe, 0, sizeof(probe));
+		memcpy(probe, base, size);
+		p = probe;
+	}
+	struct mboot_layout *l = &img->layout;
+	int ret = mboot_parse_layout(NULL, p, size, l);
+	if (ret) {
+		return ret;
+	}
+
+	if (l->hdr_size > 0) {
+		img->hdr.data = base;
+		img->hdr.size = l->hdr_size;
+	}
+	if (l->sig_size > 0) {
+		img->sig.data = base + l->hdr_size;
+		img->sig.size = l->sig_size;
+	}
+	img->cmdline.data = base + l->cmdline_offset;
+	img->cmdline.size = strnlen((const char *)img->cmdline.data, 1024);
+	img->parameter.data = base + l->parameter_offset;
+	img->parameter.size = 8;
+	img->bootstub.data = base + l->bootstub_offset;
+	img->bootstub.size = l->bootstub_size;
+	img->kernel.data = base + l->kernel_offset;
+	img->kernel.size = l->kernel_size;
+	img->ramdisk.data = base + l->ramdisk_offset;
+	img->ramdisk.size = l->ramdisk_size;
+	return MBOOT_OK;
+}
+
+int mboot_unpack_fd(int fd, struct mboot_image *img)
+{
+	struct stat st;
+
+	memset(img, 0, sizeof(*img));
+	if (fstat(fd, &st) == (-1)) {
+		return MBOOT_E_IO;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		return MBOOT_E_INVALID;
+	}
+#ifndef _WIN32
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return MBOOT_E_IO;
+	}
+#else
+	void *map = malloc(st.st_size);
+	if (!map || pread(fd, map, st.st_size, 0) != st.st_size) {
+		free(map);
+		return MBOOT_E_IO;
+	}
+#endif
+
+	int ret = mboot_unpack_mem(map, st.st_size, img);
+	img->map = map;
+	img->map_size = st.st_size;
+	if (ret) {
+		mboot_release(img);
+	}
+	return ret;
+}
+
+void mboot_release(struct mboot_image *img)
+{
+	if (img->map) {
+#ifndef _WIN32
+		munmap(img->map, img->map_size);
+#else
+		free(img->map);
+#endif
+	}
+	memset(img, 0, sizeof(*img));
+}
+
+static int check_sections(const struct mboot_image *img)
+{
+	const struct mboot_section *required[] = { &img->bootstub, &img->kernel, &img->ramdisk };
+	int i;
+	for (i = 0; i < (sizeof(required) / sizeof(required[0])); i++) {
+		if (!required[i]->data && required[i]->size) {
+			return MBOOT_E_INVALID;
+		}
+	}
+	if (img->kernel.size > UINT32_MAX || img->ramdisk.size > UINT32_MAX) {
+		return MBOOT_E_INVALID;
+	}
+	return MBOOT_OK;
+}
+
+
+long mboot_pack_mem(const struct mboot_image *img, void *out, size_t out_size)
+{
+	unsigned char *p = out;
+
+	int ret = check_sections(img);
+	if (ret) {
+		return ret;
+	}
+	long size = mboot_pack_size(img);
+	if (out_size < size) {
+		return MBOOT_E_TOO_SMALL;
+	}
+
+	long offset = build_head(img, p);
+
+	// add bootstub, kernel and ramdisk
+	const struct mboot_section *payload[] = { &img->bootstub, &img->kernel, &img->ramdisk };
+	int i;
+	for (i = 0; i < (sizeof(payload) / sizeof(payload[0])); i++) {
+		if (payload[i]->size) {
+			memcpy(p + offset, payload[i]->data, payload[i]->size);
+		}
+		offset += payload[i]->size;
+	}
+
+	// add trailing padding
+	memset(p + offset, (int)'\xFF', size - offset);
+	return size;
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	while (size > 0) {
+		ssize_t ret = write(fd, p, size);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return MBOOT_E_IO;
+		}
+		p += ret;
+		size -= ret;
+	}
+	return MBOOT_OK;
+}
+
+int mboot_pack_fd(const struct mboot_image *img, int fd)
+{
+	int ret = check_sections(img);
+	if (ret) {
+		return ret;
+	}
+
+	unsigned char *head = malloc(img->hdr.size + img->sig.size + 4096);
+	if (!head) {
+		return MBOOT_E_IO;
+	}
+	long offset = build_head(img, head);
+	ret = write_all(fd, head, offset);
+	free(head);
+
+	const struct mboot_section *payload[] = { &img->bootstub, &img->kernel, &img->ramdisk };
+	int i;
+	for (i = 0; !ret && i < (sizeof(payload) / sizeof(payload[0])); i++) {
+		ret = write_all(fd, payload[i]->data, payload[i]->size);
+		offset += payload[i]->size;
+	}
+
+	unsigned char padding[512];
+	memset(padding, (int)'\xFF', sizeof(padding));
+	if (!ret) {
+		ret = write_all(fd, padding, mboot_pack_size(img) - offset);
+	}
+	return ret;
+}
@@ -22,271 +22,407 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <glob.h>
+#endif
 
-char *directory = "./";
-char *filename = "boot.img";
-int debug = 0;
+#include "mboot.h"
 
 int usage(int val)
 {
 	fprintf(stderr,
-		"Usage: mboot.py [-u] [-f FILE] [-d DIR]\n\n"
+		"Usage: mboot.py [-u | -i | --verify | -e [--cmdline CMDLINE]] [-f FILE] [-d DIR]\n"
+		"       mboot.py [-b MANIFEST | --batch-glob PATTERN] [-d DIR] [-j JOBS]\n"
+		"       mboot.py --scan DIR [--jsonl]\n\n"
 		"Unpack an Intel boot image into separate files, OR,\n"
 		"pack a directory with kernel/ramdisk/bootstub into an Intel boot image.\n\n"
 		"Options:\n"
 		"  -h, --help            show this help message and exit\n"
 		"  -u, --unpack          split boot image into kernel, ramdisk, bootstub, etc.\n"
-		"  -f, --file FILE       use FILE to unpack/repack (default: boot.img)\n"
+		"  -i, --info            print the boot image layout as JSON without unpacking\n"
+		"  --verify              check the header checksum, sector count and imgtype of FILE\n"
+		"  --osip                list the OSII entries of the OSIP header of FILE,\n"
+		"                        with -u write each described image to DIR/osiiN.bin\n"
+		"  --find                list the boot images embedded anywhere in FILE,\n"
+		"                        with -u unpack each one to DIR/0xOFFSET\n"
+		"  -e, --edit            patch cmdline.txt/parameter from DIR into FILE in place\n"
+		"  --cmdline CMDLINE     use CMDLINE instead of cmdline.txt when editing\n"
+		"  --diff-write          pack by writing only the sectors that differ from FILE\n"
+		"  --diff-verify         with --diff-write, read FILE back uncached and compare\n"
+		"  --replace SECTION=FILE\n"
+		"                        write FILE with its kernel or ramdisk replaced to --output\n"
+		"  -f, --file FILE       use FILE to unpack/repack (default: boot.img, - for stdin/stdout)\n"
 		"  -d, --dir DIR         use DIR to unpack/repack (default: ./)\n"
+		"  --manifest            hash sections while unpacking into DIR/manifest.json\n"
+		"  --only LIST           unpack only the comma separated sections in LIST\n"
+		"                        (hdr, sig, cmdline, parameter, bootstub, kernel, ramdisk)\n"
+		"  -o, --output FILE     write the single --only section or the --replace image\n"
+		"                        to FILE (- for stdout)\n"
+		"  -b, --batch MANIFEST  run the 'IMAGE DIR pack|unpack' jobs listed in MANIFEST\n"
+		"  --batch-glob PATTERN  unpack every image matching PATTERN into DIR/<image name>\n"
+		"  --scan DIR            classify every file under DIR without unpacking anything\n"
+		"  --jsonl               print --scan results as one JSON object per line\n"
+		"  --profiles FILE       match layout fingerprints from FILE before the built-in ones\n"
+		"  --layout-cache FILE   reuse layouts detected for unchanged images, kept in FILE\n"
+		"  -j, --jobs JOBS       number of batch worker threads (default: CPU count)\n"
 	);
 	return val;
 }
 
-// use custom functions since it seems libc isalnum() cannot be trusted cross-platform
-int xisalpha(int c) { return ((unsigned int)(c|('A'^'a')) - 'a') <= 'z'-'a'; }  
-int xisdigit(int c) { return ((unsigned int)(c - '0')) < 10; } 
-int xisalnum(int c) { return (xisalpha(c) || xisdigit(c)); }
-
-int check_byte(FILE *f, int size, int min)
+// print the layout as JSON from the leading metadata blocks only, without creating any files
+int info(struct mboot_ctx *ctx)
 {
-	unsigned char *tmp = malloc(size);
-	int bytes = 0;
+	unsigned char probe[MBOOT_PROBE_SIZE];
+	struct mboot_layout l;
+
+	// a cached layout means the image does not even need opening
+	if (!mboot_cache_lookup(ctx, ctx->filename, &l)) {
+		FILE *f = fopen(ctx->filename, "rb");
+		if (!f) {
+			fprintf(stderr, "mboot: cannot open input file '%s': %s\n", ctx->filename, strerror(errno));
+			return 1;
+		}
+		int ret = mboot_load_layout(ctx, f, probe, &l);
+		fclose(f);
+		if (ret) {
+			return 1;
+		}
+	}
 
-	if (fread(tmp, size, 1, f)) {};
-	fseek(f, -size, SEEK_CUR);
+	printf("{\"file\": ");
+	mboot_json_string(stdout, ctx->filename);
+	printf(", \"image_size\": %ld, \"image_end\": %ld, \"hdr_size\": %ld, \"sig_size\": %ld, "
+		"\"cmdline_offset\": %ld, \"parameter_offset\": %ld, "
+		"\"bootstub_offset\": %ld, \"bootstub_size\": %ld, "
+		"\"kernel_offset\": %ld, \"kernel_size\": %u, "
+		"\"ramdisk_offset\": %ld, \"ramdisk_size\": %u, "
+		"\"confidence\": %d, \"runner_up\": %d}\n",
+		l.image_size, l.image_end, l.hdr_size, l.sig_size, l.cmdline_offset, l.parameter_offset,
+		l.bootstub_offset, l.bootstub_size, l.kernel_offset, l.kernel_size,
+		l.ramdisk_offset, l.ramdisk_size, l.confidence, l.runner_up);
+	return 0;
+}
 
-	int i;
-	for (i = 0; i < size; i++) {
-		bytes = bytes + xisalnum((int)tmp[i]);
-		if (debug > 1) {
-			printf("%d 0x%02X\n", bytes, tmp[i]);
+// turn a comma separated list of section names into an MBOOT_SECTION_* mask, or -1 if one is unknown
+int parse_sections(char *list)
+{
+	char *names[] = { "hdr", "sig", "cmdline", "parameter", "bootstub", "kernel", "ramdisk" };
+	int mask = 0;
+
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		int i;
+		for (i = 0; i < (sizeof(names) / sizeof(names[0])); i++) {
+			if (strlen(names[i]) == len && !strncmp(list, names[i], len)) {
+				mask |= 1 << i;
+				break;
+			}
+		}
+		if (i == (sizeof(names) / sizeof(names[0]))) {
+			return -1;
+		}
+		list += len;
+		if (*list == ',') {
+			list++;
 		}
 	}
-	free(tmp);
-	if (debug) {
-		printf("%4ld: %d\n", ftell(f), bytes);
-	}
-
-	// add custom fault tolerance to try and avoid false positives
-	return (bytes >= min);
+	return mask;
 }
 
-void write_buffer(FILE *f, int size, char *name)
+int check_directory(struct mboot_ctx *ctx)
 {
-	char outpath[PATH_MAX];
-	unsigned char *buffer = malloc(size);
+	struct stat st;
+	if (stat(ctx->directory, &st) == (-1)) {
+		fprintf(stderr, "mboot: cannot access '%s': %s\n", ctx->directory, strerror(errno));
+		return 1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "mboot: cannot access '%s': Is not a directory\n", ctx->directory);
+		return 1;
+	}
+	return 0;
+}
 
-	sprintf(outpath, "%s/%s", directory, name);
-	FILE *t = fopen(outpath, "wb");
+struct batch_job {
+	struct mboot_ctx ctx;
+	int unpack;
+	long weight;
+	int ret;
+};
+
+// each worker owns a deque of job indices, taking from the head while idle workers steal from the tail
+struct batch_queue {
+	pthread_mutex_t lock;
+	int *jobs;
+	int head;
+	int tail;
+};
+
+struct batch_pool {
+	struct batch_job *jobs;
+	int count;
+	struct batch_queue *queues;
+	int workers;
+};
+
+struct batch_worker {
+	struct batch_pool *pool;
+	int id;
+	pthread_t thread;
+};
+
+int batch_take(struct batch_queue *q, int steal)
+{
+	int job = -1;
 
-	if (fread(buffer, size, 1, f)) {};
-	fwrite(buffer, size, 1, t);
-	fclose(t);
-	free(buffer);
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		job = steal ? q->jobs[--q->tail] : q->jobs[q->head++];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return job;
 }
 
-void write_string(char *string, char *name)
+void *batch_worker(void *arg)
 {
-	char outpath[PATH_MAX];
+	struct batch_worker *w = arg;
+	struct batch_pool *pool = w->pool;
+
+	for (;;) {
+		int job = batch_take(&pool->queues[w->id], 0);
+		int i;
+		for (i = 1; job < 0 && i < pool->workers; i++) {
+			job = batch_take(&pool->queues[(w->id + i) % pool->workers], 1);
+		}
+		if (job < 0) {
+			break;
+		}
 
-	sprintf(outpath, "%s/%s", directory, name);
-	FILE *t = fopen(outpath, "w");
+		struct batch_job *j = &pool->jobs[job];
+		if (check_directory(&j->ctx)) {
+			j->ret = 1;
+		} else {
+			j->ret = j->unpack ? mboot_unpack(&j->ctx) : mboot_pack(&j->ctx);
+		}
+	}
+	return NULL;
+}
 
-	fwrite(string, strlen(string), 1, t);
-	fclose(t);
+int batch_weight_cmp(const void *a, const void *b)
+{
+	const struct batch_job *ja = a, *jb = b;
+	return (jb->weight > ja->weight) - (jb->weight < ja->weight);
 }
 
-int unpack() 
+int run_batch(struct batch_job *jobs, int count, int workers)
 {
-	FILE *f = fopen(filename, "rb");
-	if (!f) {
-		fprintf(stderr, "mboot: cannot open input file '%s': %s\n", filename, strerror(errno));
-		return 1;
+	int i;
+
+	// estimate each job's cost from its input size so the largest ones start first
+	for (i = 0; i < count; i++) {
+		struct stat st;
+		if (jobs[i].unpack) {
+			jobs[i].weight = stat(jobs[i].ctx.filename, &st) == 0 ? st.st_size : 0;
+		} else {
+			jobs[i].weight = mboot_file_size(&jobs[i].ctx, "kernel") + mboot_file_size(&jobs[i].ctx, "ramdisk.cpio.gz");
+		}
 	}
+	qsort(jobs, count, sizeof(jobs[0]), batch_weight_cmp);
 
-	// header is 512 bytes but may rarely not exist on some devices
-	if (!check_byte(f, 1, 1)) {
-		write_buffer(f, 512, "hdr");
+	if (workers > count) {
+		workers = count;
+	}
+	if (workers < 1) {
+		workers = 1;
 	}
-	int hdr_size = ftell(f);
-	printf("header size   %d\n", hdr_size);
 
-	// header may have 480, 728 or 1024 bytes of signature appended on some devices
-	int sig_deltas[] = { 0, 480, 248, 296 };
-	int i;
-	for (i = 0; i < (sizeof(sig_deltas) / sizeof(sig_deltas[0])); i++) {
-		fseek(f, sig_deltas[i], SEEK_CUR);
-		if (check_byte(f, 4, 4)) {
+	struct batch_pool pool;
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.workers = workers;
+	pool.queues = calloc(workers, sizeof(struct batch_queue));
+	for (i = 0; i < workers; i++) {
+		pthread_mutex_init(&pool.queues[i].lock, NULL);
+		pool.queues[i].jobs = malloc(sizeof(int) * (count / workers + 1));
+	}
+	for (i = 0; i < count; i++) {
+		struct batch_queue *q = &pool.queues[i % workers];
+		q->jobs[q->tail++] = i;
+	}
+
+	// workers that fail to start leave their queues to be stolen from by the others
+	struct batch_worker *w = calloc(workers, sizeof(struct batch_worker));
+	int started;
+	for (started = 0; started < workers; started++) {
+		w[started].pool = &pool;
+		w[started].id = started;
+		int err = pthread_create(&w[started].thread, NULL, batch_worker, &w[started]);
+		if (err) {
+			fprintf(stderr, "mboot: cannot create worker thread: %s\n", strerror(err));
 			break;
 		}
 	}
-	int sig_size = ftell(f) - hdr_size;
-	if (sig_size > 0) {
-		fseek(f, -sig_size, SEEK_CUR);
-		write_buffer(f, sig_size, "sig");
-	}
-	printf("sig size      %d\n", sig_size);
-
-	// cmdline is up to 1024 bytes padded with \x00
-	char *cmdline[1024];
-	if (fread(cmdline, 1024, 1, f)) {};
-	write_string((char *)cmdline, "cmdline.txt");
-
-	// image info is the next 16 bytes padded out to 3072 bytes
-	uint8_t kernel_size_buffer[4];
-	if (fread(kernel_size_buffer, 4, 1, f)) {};
-	uint8_t ramdisk_size_buffer[4];
-	if (fread(ramdisk_size_buffer, 4, 1, f)) {};
-	write_buffer(f, 8, "parameter");
-	fseek(f, 3072 - 16, SEEK_CUR);
-
-	// bootstub is 4096 bytes but can be 8192 bytes on some devices
-	fseek(f, 4096, SEEK_CUR);
-	if (check_byte(f, 2, 1)) {
-		fseek(f, 4096, SEEK_CUR);
-	}
-	int bootstub_size = ftell(f) - hdr_size - sig_size - 4096;
-	fseek(f, -bootstub_size, SEEK_CUR);
-	write_buffer(f, bootstub_size, "bootstub");
-	printf("bootstub size %d\n", bootstub_size);
-
-	uint32_t kernel_size = *(uint32_t *)kernel_size_buffer;
-	if (kernel_size < 500000 || kernel_size > 15000000) {
-		fprintf(stderr, "mboot: unpacking error: kernel size likely wrong\n");
-		return 1;
+	// the calling thread drains every queue itself if no worker could be started
+	if (started == 0) {
+		struct batch_worker self;
+		memset(&self, 0, sizeof(self));
+		self.pool = &pool;
+		batch_worker(&self);
 	}
-	write_buffer(f, kernel_size, "kernel");
-	printf("kernel size   %d\n", kernel_size);
-
-	uint32_t ramdisk_size = *(uint32_t *)ramdisk_size_buffer;
-	if (ramdisk_size < 10000 || ramdisk_size > 300000000) {
-		fprintf(stderr, "mboot: unpacking error: ramdisk size likely wrong\n");
-		return 1;
+	for (i = 0; i < started; i++) {
+		pthread_join(w[i].thread, NULL);
 	}
-	write_buffer(f, ramdisk_size, "ramdisk.cpio.gz");
-	printf("ramdisk size  %d\n", ramdisk_size);
 
-	fclose(f);
-	return 0;
-}
-
-void *read_file(char *name, unsigned *_size)
-{
-	char inpath[PATH_MAX];
-
-	sprintf(inpath, "%s/%s", directory, name);
-	FILE *t = fopen(inpath, "rb");
-	if (!t) {
-		return 0;
+	int failed = 0;
+	for (i = 0; i < count; i++) {
+		if (jobs[i].ret) {
+			fprintf(stderr, "mboot: batch: cannot %s '%s'\n", jobs[i].unpack ? "unpack" : "pack", jobs[i].ctx.filename);
+			failed++;
+		} else if (jobs[i].ctx.debug) {
+			printf("%s %s\n", jobs[i].unpack ? "unpacked" : "packed", jobs[i].ctx.filename);
+		}
 	}
-	fseek(t, 0, SEEK_END);
-	int size = ftell(t);
 
-	unsigned char *data = malloc(size);
-	fseek(t, 0, SEEK_SET);
-	if (fread(data, size, 1, t)) {};
-	fwrite(data, size, 1, t);
-	fclose(t);
-
-	if (_size) {
-		*_size = size;
+	for (i = 0; i < pool.workers; i++) {
+		pthread_mutex_destroy(&pool.queues[i].lock);
+		free(pool.queues[i].jobs);
 	}
-	return data;
+	free(pool.queues);
+	free(w);
+	return failed ? 1 : 0;
 }
 
-int pack() 
+// add a job to a growing job list
+struct batch_job *batch_add(struct batch_job *jobs, int *count, struct mboot_ctx *base, char *image, char *dir, int unpack)
 {
-	uint32_t hdr_size = 0;
-	void *hdr_data = read_file("hdr", &hdr_size);
-
-	uint32_t sig_size = 0;
-	void *sig_data = read_file("sig", &sig_size);
+	jobs = realloc(jobs, sizeof(struct batch_job) * (*count + 1));
+	struct batch_job *j = &jobs[(*count)++];
+	memset(j, 0, sizeof(*j));
+	j->ctx = *base;
+	j->ctx.filename = strdup(image);
+	j->ctx.directory = strdup(dir);
+	j->ctx.quiet = 1;
+	j->unpack = unpack;
+	return jobs;
+}
 
-	char *required_file[] = { "cmdline.txt", "parameter", "bootstub", "kernel", "ramdisk.cpio.gz" };
-	uint32_t required_size[5];
-	void *required_data[5] = { 0, 0, 0, 0, 0 };
+// free a job list along with the paths batch_add() copied into it
+void batch_free(struct batch_job *jobs, int count)
+{
 	int i;
-	for (i = 0; i < (sizeof(required_file) / sizeof(required_file[0])); i++) {
-		required_data[i] = read_file(required_file[i], &required_size[i]);
-		if (!required_data[i]) {
-			fprintf(stderr, "mboot: cannot open input file '%s': %s\n", required_file[i], strerror(errno));
-			return 1;
-		}
+	for (i = 0; i < count; i++) {
+		free(jobs[i].ctx.filename);
+		free(jobs[i].ctx.directory);
 	}
+	free(jobs);
+}
 
-	FILE *f = fopen(filename, "wb");
-	if (!f) {
-		fprintf(stderr, "mboot: cannot open output file '%s': %s\n", filename, strerror(errno));
+int batch_manifest(struct mboot_ctx *base, char *manifest, int workers)
+{
+	FILE *m = fopen(manifest, "r");
+	if (!m) {
+		fprintf(stderr, "mboot: cannot open batch manifest '%s': %s\n", manifest, strerror(errno));
 		return 1;
 	}
 
-	// calculate image size and size of padding to next full 512 byte sector
-	int img_size = hdr_size + sig_size + 4096 + required_size[2] + required_size[3] + required_size[4];
-	int padding_size = 512 - (img_size % 512) < 512 ? 512 - (img_size % 512) : 0;
+	struct batch_job *jobs = NULL;
+	int count = 0;
+	int lineno = 0;
+	char line[PATH_MAX * 2 + 32];
+	while (fgets(line, sizeof(line), m)) {
+		char image[PATH_MAX], dir[PATH_MAX], mode[16];
+		lineno++;
+
+		char *p = line + strspn(line, " \t\r\n");
+		if (*p == '\0' || *p == '#') {
+			continue;
+		}
+		if (sscanf(p, "%4095s %4095s %15s", image, dir, mode) != 3 || (strcmp(mode, "pack") && strcmp(mode, "unpack"))) {
+			fprintf(stderr, "mboot: %s:%d: expected 'IMAGE DIR pack|unpack'\n", manifest, lineno);
+			fclose(m);
+			batch_free(jobs, count);
+			return 1;
+		}
+		jobs = batch_add(jobs, &count, base, image, dir, !strcmp(mode, "unpack"));
+	}
+	fclose(m);
 
-	unsigned char *bootimg = malloc(img_size + padding_size);
+	int ret = run_batch(jobs, count, workers);
+	batch_free(jobs, count);
+	return ret;
+}
 
-	// add header if present
-	if (hdr_data) {
-		memcpy(bootimg, hdr_data, hdr_size);
+int batch_glob(struct mboot_ctx *base, char *pattern, int workers)
+{
+#ifdef _WIN32
+	fprintf(stderr, "mboot: --batch-glob is not supported on this platform\n");
+	return 1;
+#else
+	glob_t g;
+	if (glob(pattern, 0, NULL, &g)) {
+		fprintf(stderr, "mboot: no images match '%s'\n", pattern);
+		return 1;
 	}
 
-	// add signature if present and add parameter padding magic for signed image
-	if (sig_data) {
-		memcpy(bootimg + hdr_size, sig_data, sig_size);
-		memcpy(bootimg + (hdr_size + sig_size + 1024 + 16), "\xBD\x02\xBD\x02\xBD\x12\xBD\x12", 8);
-	//  adjust header imgtype based on signature presence
-	} else if (hdr_data) {
-		unsigned char *imgtype_buffer = malloc(4);
-		memcpy(imgtype_buffer, bootimg + 52, 4);
-		uint32_t imgtype = *(uint32_t *)imgtype_buffer|0x01;
-		memcpy(bootimg + 52, &imgtype, 4);
-		free(imgtype_buffer);
+	struct batch_job *jobs = NULL;
+	int count = 0;
+	size_t i;
+	for (i = 0; i < g.gl_pathc; i++) {
+		// unpack each image into a directory named after it, without its extension
+		char dir[PATH_MAX];
+		char *name = strrchr(g.gl_pathv[i], '/');
+		name = name ? name + 1 : g.gl_pathv[i];
+		snprintf(dir, sizeof(dir), "%s/%s", base->directory, name);
+		char *ext = strrchr(dir, '.');
+		if (ext && ext > strrchr(dir, '/') + 1) {
+			*ext = '\0';
+		}
+		if (mkdir(dir, 0755) == (-1) && errno != EEXIST) {
+			fprintf(stderr, "mboot: cannot create '%s': %s\n", dir, strerror(errno));
+			continue;
+		}
+		jobs = batch_add(jobs, &count, base, g.gl_pathv[i], dir, 1);
 	}
+	globfree(&g);
 
-	// add cmdline, image info (kernel and ramdisk sizes), and parameter to their 4096 byte block
-	memcpy(bootimg + (hdr_size + sig_size), required_data[0], required_size[0]);
-	memcpy(bootimg + (hdr_size + sig_size + 1024), &required_size[3], sizeof(required_size[3]));
-	memcpy(bootimg + (hdr_size + sig_size + 1024 + 4), &required_size[4], sizeof(required_size[4]));
-	memcpy(bootimg + (hdr_size + sig_size + 1024 + 8), required_data[1], required_size[1]);
-
-	// add bootstub, kernel and ramdisk
-	memcpy(bootimg + (hdr_size + sig_size + 4096), required_data[2], required_size[2]);
-	memcpy(bootimg + (hdr_size + sig_size + 4096 + required_size[2]), required_data[3], required_size[3]);
-	memcpy(bootimg + (hdr_size + sig_size + 4096 + required_size[2] + required_size[3]), required_data[4], required_size[4]);
-
-	// add trailing padding
-	memset(bootimg + img_size, (int)'\xFF', padding_size);
-
-	// update sector count and xor checksum in header
-	if (hdr_data) {
-		uint32_t sectors = ((img_size + padding_size) / 512 - 1);
-		memcpy(bootimg + 48, &sectors, 4);
+	int ret = run_batch(jobs, count, workers);
+	batch_free(jobs, count);
+	return ret;
+#endif
+}
 
-		uint8_t xor = 0;
-		unsigned char *hdr_calc = malloc(56);
-		memcpy(hdr_calc, bootimg, 56);
-		memcpy(hdr_calc + 7, "\x00", 1);
-		for (i = 0; i < 56; i++) {
-			xor ^= hdr_calc[i];
-		}
-		memcpy(bootimg + 7, &xor, 1);
-		free(hdr_calc);
+int cpu_count()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) {
+		return n;
 	}
-
-	fwrite(bootimg, img_size + padding_size, 1, f);
-	fclose(f);
-	free(bootimg);
-	return 0;
+#endif
+	return 1;
 }
 
-int main(int argc, char **argv)
+// parse the options into ctx and run the job they select
+static int run(struct mboot_ctx *ctx, int argc, char **argv)
 {
 	int unpackimg = 0;
+	int infoimg = 0;
+	int editimg = 0;
+	int verifyimg = 0;
+	int osipimg = 0;
+	int findimg = 0;
+	char *cmdline = NULL;
+	char *replace_kernel = NULL;
+	char *replace_ramdisk = NULL;
+	char *manifest = NULL;
+	char *pattern = NULL;
+	char *scandir = NULL;
+	int jsonl = 0;
+	int workers = cpu_count();
 
-	argc--;
-	argv++;
 	while (argc > 0) {
 		char *arg = argv[0];
 		if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
@@ -295,12 +431,49 @@ int main(int argc, char **argv)
 			unpackimg = 1;
 			argc -= 1;
 			argv += 1;
+		} else if (!strcmp(arg, "-i") || !strcmp(arg, "--info")) {
+			infoimg = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--verify")) {
+			verifyimg = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--find")) {
+			findimg = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--osip")) {
+			osipimg = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "-e") || !strcmp(arg, "--edit")) {
+			editimg = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--diff-write")) {
+			ctx->diff_write = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--diff-verify")) {
+			ctx->diff_write = 1;
+			ctx->verify_write = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--manifest")) {
+			ctx->manifest = 1;
+			argc -= 1;
+			argv += 1;
+		} else if (!strcmp(arg, "--jsonl")) {
+			jsonl = 1;
+			argc -= 1;
+			argv += 1;
 		} else if (!strcmp(arg, "--debug")) {
-			debug = 1;
+			ctx->debug = 1;
 			argc -= 1;
 			argv += 1;
 		} else if (!strcmp(arg, "--debug-more")) {
-			debug = 2;
+			ctx->debug = 2;
 			argc -= 1;
 			argv += 1;
 		} else if (argc >= 2) {
@@ -308,9 +481,45 @@ int main(int argc, char **argv)
 			argc -= 2;
 			argv += 2;
 			if (!strcmp(arg, "-f") || !strcmp(arg, "--file")) {
-				filename = val;
+				ctx->filename = val;
 			} else if (!strcmp(arg, "-d") || !strcmp(arg, "--dir")) {
-				directory = val;
+				ctx->directory = val;
+			} else if (!strcmp(arg, "-b") || !strcmp(arg, "--batch")) {
+				manifest = val;
+			} else if (!strcmp(arg, "--layout-cache")) {
+				mboot_cache_close(ctx->cache);
+				ctx->cache = mboot_cache_open(val);
+			} else if (!strcmp(arg, "--profiles")) {
+				mboot_profiles_free(ctx->profiles);
+				ctx->profiles = mboot_profiles_load(val);
+				if (!ctx->profiles) {
+					return 1;
+				}
+			} else if (!strcmp(arg, "--scan")) {
+				scandir = val;
+			} else if (!strcmp(arg, "--batch-glob")) {
+				pattern = val;
+			} else if (!strcmp(arg, "-j") || !strcmp(arg, "--jobs")) {
+				workers = atoi(val);
+			} else if (!strcmp(arg, "--cmdline")) {
+				cmdline = val;
+			} else if (!strcmp(arg, "--replace")) {
+				if (!strncmp(val, "kernel=", 7)) {
+					replace_kernel = val + 7;
+				} else if (!strncmp(val, "ramdisk=", 8)) {
+					replace_ramdisk = val + 8;
+				} else {
+					fprintf(stderr, "mboot: can only replace kernel=FILE or ramdisk=FILE\n");
+					return usage(1);
+				}
+			} else if (!strcmp(arg, "--only")) {
+				ctx->sections = parse_sections(val);
+				if (ctx->sections <= 0) {
+					fprintf(stderr, "mboot: unknown section in '%s'\n", val);
+					return usage(1);
+				}
+			} else if (!strcmp(arg, "-o") || !strcmp(arg, "--output")) {
+				ctx->output = val;
 			} else {
 				return usage(1);
 			}
@@ -319,19 +528,77 @@ int main(int argc, char **argv)
 		}
 	}
 
-	struct stat st;
-	if (stat(directory, &st) == (-1)) {
-		fprintf(stderr, "mboot: cannot access '%s': %s\n", directory, strerror(errno));
-		return 1;
+	if (infoimg) {
+		return info(ctx);
 	}
-	if (!S_ISDIR(st.st_mode)) {
-		fprintf(stderr, "mboot: cannot access '%s': Is not a directory\n", directory);
+	if (verifyimg) {
+		return mboot_verify(ctx);
+	}
+	if (scandir) {
+		return mboot_scan(ctx, scandir, jsonl);
+	}
+	if (manifest) {
+		return batch_manifest(ctx, manifest, workers);
+	}
+
+	if (replace_kernel || replace_ramdisk) {
+		if (!ctx->output) {
+			fprintf(stderr, "mboot: --replace needs an --output image\n");
+			return 1;
+		}
+		return mboot_replace(ctx, replace_kernel, replace_ramdisk);
+	}
+	if (ctx->output) {
+		// a single output file can only hold one section
+		if (!ctx->sections || (ctx->sections & (ctx->sections - 1))) {
+			fprintf(stderr, "mboot: --output needs exactly one section selected with --only\n");
+			return 1;
+		}
+		if (!strcmp(ctx->output, "-")) {
+			ctx->quiet = 1;
+		}
+		return mboot_unpack(ctx);
+	}
+
+	if (osipimg && !unpackimg) {
+		return mboot_osip(ctx, 0);
+	}
+	if (findimg && !unpackimg) {
+		return mboot_find(ctx, 0);
+	}
+
+	if (check_directory(ctx)) {
 		return 1;
 	}
+	if (osipimg) {
+		return mboot_osip(ctx, 1);
+	}
+	if (findimg) {
+		return mboot_find(ctx, 1);
+	}
+	if (pattern) {
+		return batch_glob(ctx, pattern, workers);
+	}
+	if (editimg) {
+		return mboot_edit(ctx, cmdline);
+	}
 
-	if (unpackimg) {
-		return unpack();
+	if (unpackimg || ctx->sections) {
+		return mboot_unpack(ctx);
 	} else {
-		return pack();
+		return mboot_pack(ctx);
 	}
 }
+
+int main(int argc, char **argv)
+{
+	struct mboot_ctx ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.directory = "./";
+	ctx.filename = "boot.img";
+
+	int ret = run(&ctx, argc - 1, argv + 1);
+	mboot_cache_close(ctx.cache);
+	mboot_profiles_free(ctx.profiles);
+	return ret;
+}
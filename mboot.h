@@ -0,0 +1,233 @@
+/* mboot.h - unpack and repack Intel boot.img for Android
+**
+** Copyright 2014 Jocelyn Falempe (Intel Corporation)
+** Copyright 2019 Chris Renshaw (osm0sis @ xda-developers)
+**                Shaka Huang (shakalaca @ xda-developers / ASUS ZenTalk)
+**
+** This program is free software; you can redistribute it and/or modify it
+** under the terms and conditions of the GNU General Public License,
+** version 2, as published by the Free Software Foundation.
+**
+** This program is distributed in the hope it will be useful, but WITHOUT
+** ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+** FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+** more details.
+*/
+
+#ifndef _MBOOT_H_
+#define _MBOOT_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// enough leading bytes of an image to detect the whole layout from
+#define MBOOT_PROBE_SIZE 16384
+
+// error codes returned by the library, describe them with mboot_strerror()
+#define MBOOT_OK               0
+#define MBOOT_E_KERNEL_SIZE   -1
+#define MBOOT_E_RAMDISK_SIZE  -2
+#define MBOOT_E_TRUNCATED     -3
+#define MBOOT_E_IO            -4
+#define MBOOT_E_TOO_SMALL     -5
+#define MBOOT_E_INVALID       -6
+
+// sections that can be selected for extraction, ctx->sections = 0 selects all of them
+#define MBOOT_SECTION_HDR        (1 << 0)
+#define MBOOT_SECTION_SIG        (1 << 1)
+#define MBOOT_SECTION_CMDLINE    (1 << 2)
+#define MBOOT_SECTION_PARAMETER  (1 << 3)
+#define MBOOT_SECTION_BOOTSTUB   (1 << 4)
+#define MBOOT_SECTION_KERNEL     (1 << 5)
+#define MBOOT_SECTION_RAMDISK    (1 << 6)
+
+// offsets and sizes of every section of an image
+struct mboot_layout {
+	long hdr_size;
+	long sig_size;
+	long cmdline_offset;
+	long parameter_offset;
+	long bootstub_offset;
+	long bootstub_size;
+	long kernel_offset;
+	uint32_t kernel_size;
+	long ramdisk_offset;
+	uint32_t ramdisk_size;
+
+	// size of the file or device holding the image, and where the image itself ends in it
+	long image_size;
+	long image_end;
+	int end_unknown;
+
+	// detection score out of 100 of the chosen hdr/sig/bootstub combination, and the best score of any other
+	int confidence;
+	int runner_up;
+};
+
+// persistent cache of detected layouts, see mboot_cache_open()
+struct mboot_cache;
+
+// fingerprint to layout table, see mboot_profiles_load()
+struct mboot_profiles;
+
+// an Intel OSIP header describes up to this many OS images (OSII entries) in its 512 bytes
+#define MBOOT_OSII_MAX 20
+
+// one OSII entry, sizes and block numbers are in 512 byte sectors
+struct mboot_osii {
+	uint16_t os_rev_minor;
+	uint16_t os_rev_major;
+	uint32_t logical_start_block;
+	uint32_t ddr_load_address;
+	uint32_t entry_point;
+	uint32_t size_of_os_image;
+	uint8_t attribute;
+
+	// where the described image is in the file, clamped to the end of the file
+	long offset;
+	long size;
+};
+
+struct mboot_osip {
+	uint8_t header_rev_minor;
+	uint8_t header_rev_major;
+	uint8_t checksum;
+	uint8_t num_pointers;
+	uint8_t num_images;
+	uint16_t header_size;
+	int checksum_ok;
+	int count;
+	struct mboot_osii entry[MBOOT_OSII_MAX];
+};
+
+// per-job state for the file based pack/unpack so several images can be processed at once
+struct mboot_ctx {
+	char *directory;
+	char *filename;
+	int debug;
+	int quiet;
+
+	// MBOOT_SECTION_* mask of sections to unpack, and an optional single file (or - for stdout)
+	// to write the only selected section to instead of the directory
+	int sections;
+	char *output;
+
+	// pack only the 512 byte sectors that differ from the existing output, optionally read back after
+	int diff_write;
+	int verify_write;
+
+	// hash every section while unpacking it and describe them all in ctx->directory/manifest.json
+	int manifest;
+
+	// offset of the image inside ctx->filename, for unpacking images embedded in a larger dump
+	long base;
+
+	// layouts detected before for the same file are taken from here, when set
+	struct mboot_cache *cache;
+
+	// fingerprints checked before the built-in ones, when set
+	struct mboot_profiles *profiles;
+
+	// read-only mapping of the image being unpacked, or NULL when unavailable
+	unsigned char *image_map;
+	long image_map_size;
+};
+
+// a view into caller or library owned memory, data is NULL when the section is absent
+struct mboot_section {
+	const unsigned char *data;
+	size_t size;
+};
+
+// every section of an image, as returned by mboot_unpack_mem() or passed to mboot_pack_mem()
+struct mboot_image {
+	struct mboot_layout layout;
+	struct mboot_section hdr;
+	struct mboot_section sig;
+	struct mboot_section cmdline;
+	struct mboot_section parameter;
+	struct mboot_section bootstub;
+	struct mboot_section kernel;
+	struct mboot_section ramdisk;
+
+	// mapping owned by mboot_unpack_fd(), released by mboot_release()
+	void *map;
+	size_t map_size;
+};
+
+const char *mboot_strerror(int err);
+
+// print string as a quoted and escaped JSON string
+void mboot_json_string(FILE *f, const char *string);
+
+// layout cache kept in the file at path, keyed by device, inode, size, mtime and the profiles in use,
+// and safe to share between threads; mboot_cache_lookup() checks ctx->cache at the cost of one stat()
+// and returns 1 on a hit
+struct mboot_cache *mboot_cache_open(const char *path);
+void mboot_cache_close(struct mboot_cache *c);
+int mboot_cache_lookup(struct mboot_ctx *ctx, const char *filename, struct mboot_layout *l);
+
+// profiles from a file of 'NAME [hdr=N] [sig=N] [bootstub=N] OFFSET:HEX[/MASK]...' lines, the first profile
+// whose byte patterns all match the leading bytes of an image sets the sizes it names without any probing
+struct mboot_profiles *mboot_profiles_load(const char *path);
+void mboot_profiles_free(struct mboot_profiles *list);
+
+// layout detection from the first MBOOT_PROBE_SIZE bytes (zero filled past the end of the image)
+int mboot_parse_layout(struct mboot_ctx *ctx, const unsigned char *probe, long image_size, struct mboot_layout *l);
+int mboot_load_layout(struct mboot_ctx *ctx, FILE *f, unsigned char *probe, struct mboot_layout *l);
+
+// set imgtype, sector count and xor checksum in the first 56 bytes of a header
+void mboot_finalize_header(unsigned char *hdr, long image_size, int sig_present);
+
+// check the header checksum, sector count and imgtype of ctx->filename, returns 1 if any is wrong
+int mboot_verify(struct mboot_ctx *ctx);
+
+// decode the OSIP header at the start of a 512 byte hdr, MBOOT_E_INVALID if there is none
+int mboot_parse_osip(const unsigned char *hdr, long image_size, struct mboot_osip *osip);
+
+// list the OSII entries of ctx->filename and, with extract, write each image to ctx->directory/osiiN.bin
+int mboot_osip(struct mboot_ctx *ctx, int extract);
+
+// find OSIP boot images anywhere in ctx->filename, one line per image that passes the header checksum
+// and layout checks, and with extract unpack each one to ctx->directory/0xOFFSET
+int mboot_find(struct mboot_ctx *ctx, int extract);
+
+// classify every file under dir from its leading bytes, one table row or JSON line per file
+int mboot_scan(struct mboot_ctx *ctx, const char *dir, int jsonl);
+
+// copy a range between descriptors in the kernel, returns the number of bytes it managed to copy
+long mboot_copy_range(struct mboot_ctx *ctx, int in, long offset, int out, long size);
+long mboot_file_size(struct mboot_ctx *ctx, char *name);
+
+// file based operations on ctx->filename and the files in ctx->directory
+int mboot_unpack(struct mboot_ctx *ctx);
+int mboot_pack(struct mboot_ctx *ctx);
+
+// patch cmdline (ctx->directory/cmdline.txt when NULL) and ctx->directory/parameter, if present,
+// into ctx->filename in place and refresh its header
+int mboot_edit(struct mboot_ctx *ctx, const char *cmdline);
+
+// write ctx->filename to ctx->output with the kernel and/or ramdisk (when not NULL) replaced
+int mboot_replace(struct mboot_ctx *ctx, const char *kernel, const char *ramdisk);
+
+// split an image into section views pointing into it, nothing is copied
+int mboot_unpack_mem(const void *image, size_t size, struct mboot_image *img);
+int mboot_unpack_fd(int fd, struct mboot_image *img);
+void mboot_release(struct mboot_image *img);
+
+// assemble sections into a padded image, mboot_pack_mem() returns the bytes written
+// or MBOOT_E_TOO_SMALL when out_size is less than mboot_pack_size()
+long mboot_pack_size(const struct mboot_image *img);
+long mboot_pack_mem(const struct mboot_image *img, void *out, size_t out_size);
+int mboot_pack_fd(const struct mboot_image *img, int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif